@@ -8,9 +8,24 @@
 #include <cstring>
 #include <cstdlib>
 #include <cstdint>
+#include <cstddef>
 #include <limits>
 #include <optional>
 #include <set>
+#include <map>
+#include <array>
+#include <string>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <random>
+#include <filesystem>
 
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
@@ -31,12 +46,317 @@ struct QueueFamilyIndices
 	std::optional<uint32_t> graphicsFamilyIndex;
 	std::optional<uint32_t> presentFamilyIndex;
 
-	bool isComplete()
+	bool isComplete() const
 	{
 		return graphicsFamilyIndex.has_value() && presentFamilyIndex.has_value();
 	}
 };
 
+//Values baked into a pipeline through specialization constants. Shaders declare them as
+//layout(constant_id = 0/1/2); constants a shader does not declare are ignored.
+struct PipelineVariantKey
+{
+	uint32_t sampleCount = 1; //constant_id 0 - samples per pixel
+	uint32_t bounceDepth = 1; //constant_id 1 - max path depth
+	uint32_t featureBits = 0; //constant_id 2 - material / feature toggles
+
+	bool operator<(const PipelineVariantKey& other) const
+	{
+		if (sampleCount != other.sampleCount) return sampleCount < other.sampleCount;
+		if (bounceDepth != other.bounceDepth) return bounceDepth < other.bounceDepth;
+		return featureBits < other.featureBits;
+	}
+
+	bool operator==(const PipelineVariantKey& other) const
+	{
+		return sampleCount == other.sampleCount && bounceDepth == other.bounceDepth && featureBits == other.featureBits;
+	}
+};
+
+struct PipelineVariantStats
+{
+	uint64_t requests = 0;
+	uint64_t hits = 0; //requested variant was ready
+	uint64_t fallbacks = 0; //drew with the generic variant instead of stalling on a compile
+	uint32_t compiled = 0; //variants compiled in the background
+	double compileMs = 0.0; //background compile time the render thread did not wait for
+	uint32_t failed = 0; //variants whose compile threw, drawn with the generic variant from then on
+};
+
+//Options for scripted (non-interactive) runs. frameCount == 0 means interactive.
+struct RunOptions
+{
+	uint32_t frameCount = 0; //render this many frames, then exit
+	std::string scene = "triangle"; //key used in the frame time history
+	std::string capturePath; //write the last frame to this .ppm
+	std::string goldenPath; //compare the last frame against this .ppm
+	double tolerance = 1.0; //max RMSE (0-255 scale) against the golden image
+	std::string historyPath; //append frame times to this JSON lines file
+	double maxSlowdown = 0.10; //fail if median frame time grows by more than this fraction
+	std::string exportPrefix; //write every frame to <prefix><frame number>.<format>
+	std::string exportFormat = "ppm"; //ppm or raw (swapchain bytes as they are)
+	uint32_t exportThreads = 0; //encoder threads, 0 picks from hardware concurrency
+	bool forceRenderPass = false; //use VkRenderPass/VkFramebuffer even if dynamic rendering is available
+	bool forceHeadless = false; //render to a headless surface even if a display is available
+	PipelineVariantKey variant; //pipeline variant to draw with, the generic one by default
+	uint32_t deviceCount = 1; //logical devices sharing each frame, the presenting one included
+	uint32_t sceneInstances = 0; //instances in the test scene, 0 for no scene
+	uint32_t movingInstances = 0; //instances moved every frame
+	uint32_t churnInstances = 0; //instances removed and replaced every frame
+	uint32_t pipelineSwapInterval = 0; //rebuild the generic pipeline every this many frames, 0 never
+	uint32_t meshRings = 0; //rings of the sphere used for the mesh layout benchmark, 0 to skip it
+	uint32_t sceneLights = 0; //emissive triangles in the test scene, also sizes the light sampling benchmark
+	std::string serveDirectory; //render jobs dropped into this directory until a "shutdown" file appears
+	std::string loadTestDirectory; //submit jobs to a server watching this directory and time them
+	uint32_t loadTestJobs = 200;
+	uint32_t loadTestConcurrency = 8; //jobs outstanding at once
+
+	bool isBenchmark() const
+	{
+		return frameCount > 0;
+	}
+
+	bool isServer() const
+	{
+		return !serveDirectory.empty();
+	}
+
+	bool needsCapture() const
+	{
+		return !capturePath.empty() || !goldenPath.empty();
+	}
+
+	bool needsExport() const
+	{
+		return !exportPrefix.empty();
+	}
+
+	//Servers read back every job's result through the export ring
+	bool needsReadback() const
+	{
+		return needsCapture() || needsExport() || isServer();
+	}
+};
+
+struct Image
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<uint8_t> rgb; //8 bits per channel, no padding
+};
+
+//One request of server mode, read from <id>.job in the served directory
+struct RenderJob
+{
+	std::string id; //job file name without extension, also names the results
+	PipelineVariantKey variant;
+	uint32_t frames = 1; //frames rendered for the job, the last one is the result
+	std::string format = "ppm";
+	std::chrono::steady_clock::time_point claimed;
+};
+
+//One host visible buffer of the readback ring. Mapped once at creation, never unmapped until cleanup.
+struct ReadbackSlot
+{
+	VkBuffer buffer = VK_NULL_HANDLE;
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	void* mapped = nullptr;
+	uint32_t frameIndex = 0;
+	std::optional<RenderJob> job; //server mode: the frame is this job's result
+};
+
+//Background encoders for the readback ring. A slot is busy from acquire() on the render
+//thread until a worker has finished encoding it, so the GPU never writes a slot being read.
+class ExportPool
+{
+public:
+	~ExportPool()
+	{
+		join();
+	}
+
+	void start(uint32_t threadCount, uint32_t slotCount, std::function<void(uint32_t)> encodeSlot)
+	{
+		encode = encodeSlot;
+		slotBusy.assign(slotCount, false);
+		stopping = false;
+		for (uint32_t i = 0; i < threadCount; i++)
+		{
+			workers.emplace_back([this]() { workerLoop(); });
+		}
+	}
+
+	//Blocks while encoders still hold the slot. Returns the time spent waiting in ms.
+	double acquire(uint32_t slot)
+	{
+		auto waitStart = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> lock(mutex);
+		slotReleased.wait(lock, [&]() { return !slotBusy[slot]; });
+		slotBusy[slot] = true;
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count();
+	}
+
+	//The GPU copy into the slot has completed, hand it to the encoders
+	void push(uint32_t slot)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending.push_back(slot);
+		}
+		jobAvailable.notify_one();
+	}
+
+	//Encodes everything still queued, joins the workers and rethrows the first encoder error
+	void stop()
+	{
+		join();
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+	}
+
+private:
+	void join()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		jobAvailable.notify_all();
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+		workers.clear();
+	}
+
+	void workerLoop()
+	{
+		while (true)
+		{
+			uint32_t slot;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				jobAvailable.wait(lock, [&]() { return stopping || !pending.empty(); });
+				if (pending.empty()) return;
+				slot = pending.front();
+				pending.pop_front();
+			}
+
+			std::exception_ptr encodeError;
+			try
+			{
+				encode(slot);
+			}
+			catch (...)
+			{
+				encodeError = std::current_exception();
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (encodeError && !error) error = encodeError;
+				slotBusy[slot] = false;
+			}
+			slotReleased.notify_all();
+		}
+	}
+
+	std::function<void(uint32_t)> encode;
+	std::vector<std::thread> workers;
+	std::deque<uint32_t> pending;
+	std::vector<bool> slotBusy;
+	bool stopping = false;
+	std::exception_ptr error;
+	std::mutex mutex;
+	std::condition_variable jobAvailable;
+	std::condition_variable slotReleased;
+};
+
+//Destroys objects in reverse order of registration, so dependents go before what they depend on
+struct DeletionQueue
+{
+	std::vector<std::function<void()>> deleters;
+
+	void push(std::function<void()>&& deleter)
+	{
+		deleters.push_back(std::move(deleter));
+	}
+
+	void flush()
+	{
+		for (auto it = deleters.rbegin(); it != deleters.rend(); it++)
+		{
+			(*it)();
+		}
+		deleters.clear();
+	}
+};
+
+//Live device objects per handle type. Anything still counted after cleanup() is a leak.
+struct ObjectCounter
+{
+	std::map<std::string, int> live;
+
+	void created(const std::string& type)
+	{
+		live[type]++;
+	}
+
+	void destroyed(const std::string& type)
+	{
+		live[type]--;
+	}
+
+	int leaked() const
+	{
+		int total = 0;
+		for (const auto& entry : live)
+		{
+			total += entry.second;
+		}
+		return total;
+	}
+
+	void report() const
+	{
+		for (const auto& entry : live)
+		{
+			if (entry.second != 0)
+			{
+				std::cerr << "leak: " << entry.second << " " << entry.first << " still alive at shutdown" << std::endl;
+			}
+		}
+	}
+};
+
+//A buffer that is reallocated, never resized in place, when its contents outgrow it
+struct SceneBuffer
+{
+	VkBuffer buffer = VK_NULL_HANDLE;
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize capacity = 0;
+	void* mapped = nullptr; //host visible buffers only
+};
+
+//Everything owned by one frame in flight. Its timeline value (or its fence) guards all of it.
+struct FrameData
+{
+	VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+	VkSemaphore imageAvailableSemaphore = VK_NULL_HANDLE;
+	VkSemaphore renderFinishedSemaphore = VK_NULL_HANDLE;
+	VkFence inFlightFence = VK_NULL_HANDLE; //only without timeline semaphores
+	uint64_t timelineValue = 0; //graphics timeline value reached once this frame's last submission is done
+	DeletionQueue deletionQueue; //objects retired while this frame was current, destroyed once its work is done
+	std::optional<uint32_t> exportSlot; //readback slot whose copy completes with this frame
+	VkBuffer compositeBuffer = VK_NULL_HANDLE; //peer bands staged for the copy into the swapchain image
+	VkDeviceMemory compositeMemory = VK_NULL_HANDLE;
+	void* compositeMapped = nullptr;
+	uint32_t timedRows = 0; //rows of the presenting device's band timed by this frame's queries
+	SceneBuffer sceneStaging; //changed scene records on their way to the device local buffers
+};
+
 struct SwapChainDetails
 {
 	VkSurfaceCapabilitiesKHR surfaceCapabilities; //no. of images in swapchain, dimensions of the images
@@ -44,6 +364,341 @@ struct SwapChainDetails
 	std::vector<VkPresentModeKHR> presentModes; //condition to swap images from swapchain to screen
 };
 
+//SPIR-V read from disk, ready for vkCreateShaderModule
+struct ShaderCode
+{
+	std::vector<char> vert;
+	std::vector<char> frag;
+};
+
+//Everything a graphics pipeline is built against. The presenting device and each peer device have one.
+struct PipelineTarget
+{
+	VkDevice device = VK_NULL_HANDLE;
+	VkPipelineLayout layout = VK_NULL_HANDLE;
+	VkShaderModule vertShaderModule = VK_NULL_HANDLE;
+	VkShaderModule fragShaderModule = VK_NULL_HANDLE;
+	VkRenderPass renderPass = VK_NULL_HANDLE; //VK_NULL_HANDLE with dynamic rendering
+	VkFormat colorFormat = VK_FORMAT_UNDEFINED; //only used with dynamic rendering
+	VkPipelineCache cache = VK_NULL_HANDLE;
+};
+
+//Rows of the frame one device renders. Band sizes follow each device's measured cost per row.
+struct RenderBand
+{
+	uint32_t firstRow = 0;
+	uint32_t rowCount = 0;
+	double msPerRow = 0.0; //smoothed GPU time per row, 0 until measured
+	double totalMs = 0.0;
+	uint32_t timedFrames = 0;
+
+	void addSample(double ms, uint32_t rows)
+	{
+		if (rows == 0)
+		{
+			return;
+		}
+		double sample = ms / rows;
+		msPerRow = msPerRow == 0.0 ? sample : msPerRow * 0.9 + sample * 0.1;
+		totalMs += ms;
+		timedFrames++;
+	}
+};
+
+//Another logical device rendering one band of every frame into an offscreen image. The band is read
+//back into host memory and composited into the swapchain image by the presenting device.
+struct PeerDevice
+{
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	VkQueue queue = VK_NULL_HANDLE;
+	PipelineTarget pipelineTarget;
+	std::map<PipelineVariantKey, VkPipeline> pipelines; //by variant, ready to draw with
+	std::map<PipelineVariantKey, std::future<VkPipeline>> pendingPipelines; //compiling on a worker
+	std::set<PipelineVariantKey> failedPipelines; //threw while compiling, drawn with the startup variant for good
+	VkPipeline startupPipeline = VK_NULL_HANDLE; //drawn while the requested variant compiles
+	VkImage image = VK_NULL_HANDLE;
+	VkDeviceMemory imageMemory = VK_NULL_HANDLE;
+	VkImageView imageView = VK_NULL_HANDLE;
+	VkFramebuffer framebuffer = VK_NULL_HANDLE;
+	VkCommandPool commandPool = VK_NULL_HANDLE;
+	VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+	VkFence fence = VK_NULL_HANDLE;
+	VkBuffer readbackBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory readbackMemory = VK_NULL_HANDLE;
+	void* readbackMapped = nullptr;
+	VkQueryPool timestampPool = VK_NULL_HANDLE; //start and end of the band, null if the queue has no timestamps
+	float timestampPeriod = 1.0f; //ns per tick
+	uint32_t submittedFirstRow = 0; //band in flight, collected during the next frame
+	uint32_t submittedRows = 0;
+	uint32_t stagedFirstRow = 0; //band staged in the current frame's composite buffer
+	uint32_t stagedRows = 0;
+	DeletionQueue deletionQueue; //flushed before the device itself is destroyed
+};
+
+//One scene instance, laid out like VkAccelerationStructureInstanceKHR. The material index is the
+//instance custom index (gl_InstanceCustomIndexEXT in hit shaders). Once the mesh has a bottom-level
+//acceleration structure, its device address goes into accelerationStructureReference and the instance
+//buffer can be the input of a top-level build as it is.
+struct InstanceRecord
+{
+	float transform[3][4] = { { 1.0f, 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f, 0.0f } }; //row major 3x4
+	uint32_t materialIndex : 24;
+	uint32_t mask : 8; //visible to rays whose cull mask shares a bit
+	uint32_t shaderBindingTableOffset : 24;
+	uint32_t flags : 8; //VkGeometryInstanceFlagsKHR
+	uint64_t accelerationStructureReference = 0;
+
+	InstanceRecord() : materialIndex(0), mask(0xFF), shaderBindingTableOffset(0), flags(0) {}
+};
+static_assert(sizeof(InstanceRecord) == sizeof(VkAccelerationStructureInstanceKHR), "InstanceRecord must match VkAccelerationStructureInstanceKHR");
+
+struct MaterialRecord
+{
+	float baseColor[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	float roughness = 1.0f;
+	float metallic = 0.0f;
+	float padding[2] = {};
+};
+
+//One emissive triangle plus its entry of the light alias table. Picking a light takes one uniform index i
+//and one comparison: i if u < aliasProbability, else alias. pdf is the chance of picking this light, which
+//next-event estimation divides by and multiple importance sampling weighs against the BSDF's pdf.
+struct LightRecord
+{
+	float position[3][4] = {}; //xyz of each vertex, w unused
+	float emission[4] = {}; //rgb radiance, a unused
+	float aliasProbability = 1.0f;
+	uint32_t alias = 0;
+	float pdf = 0.0f;
+	float padding = 0.0f;
+};
+
+//Host copy of a GPU record array plus the records changed since the last upload
+template<typename T>
+struct TrackedRecords
+{
+	std::vector<T> records;
+	std::set<uint32_t> dirty;
+
+	uint32_t add(const T& record)
+	{
+		records.push_back(record);
+		uint32_t index = static_cast<uint32_t>(records.size() - 1);
+		dirty.insert(index);
+		return index;
+	}
+
+	T& edit(uint32_t index)
+	{
+		dirty.insert(index);
+		return records[index];
+	}
+
+	void markAllDirty()
+	{
+		for (uint32_t i = 0; i < records.size(); i++)
+		{
+			dirty.insert(i);
+		}
+	}
+
+	//Dirty indices coalesced into (first, count) runs, one copy region each
+	std::vector<std::pair<uint32_t, uint32_t>> dirtyRanges() const
+	{
+		std::vector<std::pair<uint32_t, uint32_t>> ranges;
+		for (uint32_t index : dirty)
+		{
+			if (index >= records.size())
+			{
+				continue; //removed since it was marked
+			}
+			if (!ranges.empty() && ranges.back().first + ranges.back().second == index)
+			{
+				ranges.back().second++;
+			}
+			else
+			{
+				ranges.push_back({ index, 1 });
+			}
+		}
+		return ranges;
+	}
+};
+
+//Instances and materials of the scene. Instances have stable ids while their records stay densely
+//packed: removing one moves the last record into its slot, so only that record has to be uploaded again.
+//Materials are only ever added, instances refer to them by index.
+class Scene
+{
+public:
+	TrackedRecords<InstanceRecord> instances;
+	TrackedRecords<MaterialRecord> materials;
+	TrackedRecords<LightRecord> lights;
+
+	uint32_t addMaterial(const MaterialRecord& material)
+	{
+		return materials.add(material);
+	}
+
+	void setMaterial(uint32_t material, const MaterialRecord& record)
+	{
+		materials.edit(material) = record;
+	}
+
+	//Every record's alias table entry depends on every light's power, so lights are replaced as a whole
+	void setLights(const std::vector<LightRecord>& records)
+	{
+		lights.records = records;
+		lights.dirty.clear();
+		lights.markAllDirty();
+	}
+
+	uint32_t addInstance(const InstanceRecord& instance)
+	{
+		uint32_t id = static_cast<uint32_t>(slotOfInstance.size());
+		slotOfInstance.push_back(instances.add(instance));
+		instanceOfSlot.push_back(id);
+		return id;
+	}
+
+	void setTransform(uint32_t id, const float transform[3][4])
+	{
+		memcpy(instances.edit(slot(id)).transform, transform, sizeof(InstanceRecord::transform));
+	}
+
+	void setInstanceMaterial(uint32_t id, uint32_t material)
+	{
+		instances.edit(slot(id)).materialIndex = material;
+	}
+
+	void removeInstance(uint32_t id)
+	{
+		uint32_t removed = slot(id);
+		uint32_t last = static_cast<uint32_t>(instances.records.size() - 1);
+		if (removed != last)
+		{
+			instances.edit(removed) = instances.records[last];
+			instanceOfSlot[removed] = instanceOfSlot[last];
+			slotOfInstance[instanceOfSlot[removed]] = removed;
+		}
+		instances.records.pop_back();
+		instanceOfSlot.pop_back();
+		instances.dirty.erase(last);
+		slotOfInstance[id] = removedSlot;
+	}
+
+	uint32_t instanceCount() const
+	{
+		return static_cast<uint32_t>(instances.records.size());
+	}
+
+private:
+	static const uint32_t removedSlot = std::numeric_limits<uint32_t>::max();
+	std::vector<uint32_t> slotOfInstance; //instance id -> record index
+	std::vector<uint32_t> instanceOfSlot; //record index -> instance id
+
+	uint32_t slot(uint32_t id) const
+	{
+		if (id >= slotOfInstance.size() || slotOfInstance[id] == removedSlot)
+		{
+			throw std::runtime_error("Unknown scene instance " + std::to_string(id));
+		}
+		return slotOfInstance[id];
+	}
+};
+
+struct SceneUploadStats
+{
+	uint64_t uploadedBytes = 0;
+	uint64_t maxFrameBytes = 0;
+	uint32_t frames = 0;
+	uint32_t inPlaceUpdates = 0; //uploads that only rewrote changed records
+	uint32_t rebuilds = 0; //uploads that had to reallocate the device buffers
+	double updateMs = 0.0; //host time recording in place updates
+	double rebuildMs = 0.0; //host time recording rebuilds, reallocation included
+};
+
+//Interleaved vertex as mesh loaders produce it
+struct MeshVertex
+{
+	float position[3];
+	float normal[3];
+	float uv[2];
+};
+
+struct Mesh
+{
+	std::vector<MeshVertex> vertices;
+	std::vector<uint32_t> indices; //triangle list
+};
+
+//Structure of arrays: positions are a stream of their own, so traversal and position only passes never
+//pull normals or UVs into the cache. Quantized streams replace the float ones when requested.
+struct MeshStreams
+{
+	std::vector<float> positions; //xyz
+	std::vector<float> normals; //xyz, empty when quantized
+	std::vector<float> uvs; //uv, empty when quantized
+	std::vector<int16_t> octNormals; //octahedral, 2 x snorm16
+	std::vector<uint16_t> quantizedUVs; //2 x unorm16, only if every UV is within [0, 1]
+	std::vector<uint32_t> indices;
+
+	size_t bytes() const
+	{
+		return positions.size() * sizeof(float) + normals.size() * sizeof(float) + uvs.size() * sizeof(float)
+			+ octNormals.size() * sizeof(int16_t) + quantizedUVs.size() * sizeof(uint16_t) + indices.size() * sizeof(uint32_t);
+	}
+
+	//Bytes fetched per vertex, one element from every stream
+	size_t vertexStride() const
+	{
+		size_t normalBytes = octNormals.empty() ? 3 * sizeof(float) : 2 * sizeof(int16_t);
+		size_t uvBytes = quantizedUVs.empty() ? 2 * sizeof(float) : 2 * sizeof(uint16_t);
+		return 3 * sizeof(float) + normalBytes + uvBytes;
+	}
+};
+
+//Start/end of every startup step and the thread it ran on, relative to Engine::run()
+struct StartupTimeline
+{
+	struct Step
+	{
+		std::string name;
+		bool onWorker;
+		double startMs;
+		double endMs;
+	};
+
+	std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+	std::thread::id mainThread = std::this_thread::get_id();
+	std::vector<Step> steps;
+	std::mutex mutex;
+
+	double now() const
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	void measure(const std::string& name, const std::function<void()>& step)
+	{
+		double start = now();
+		step();
+		double end = now();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		steps.push_back({ name, std::this_thread::get_id() != mainThread, start, end });
+	}
+
+	void report() const
+	{
+		for (const auto& step : steps)
+		{
+			std::cout << "startup: " << (step.onWorker ? "[worker] " : "[main]   ") << step.name << " " << step.startMs << " - " << step.endMs << " ms" << std::endl;
+		}
+	}
+};
+
 VkResult CreateDebugUtilsMessengerEXT(VkInstance instance, const VkDebugUtilsMessengerCreateInfoEXT* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDebugUtilsMessengerEXT* pDebugMessenger) {
 	auto func = (PFN_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instance, "vkCreateDebugUtilsMessengerEXT");
 	if (func != nullptr) {
@@ -60,14 +715,60 @@ void DestroyDebugUtilsMessengerEXT(VkInstance instance, VkDebugUtilsMessengerEXT
 	}
 }
 
+//Two timestamps per timed band. Returns VK_NULL_HANDLE when the queue family cannot write timestamps.
+VkQueryPool createTimestampPool(const VkDevice& vkDevice, const VkPhysicalDevice& vkPhysicalDevice, uint32_t queueFamily, uint32_t queryCount, float& timestampPeriod)
+{
+	uint32_t familyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(vkPhysicalDevice, &familyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> families(familyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(vkPhysicalDevice, &familyCount, families.data());
+	if (queueFamily >= familyCount || families[queueFamily].timestampValidBits == 0)
+	{
+		return VK_NULL_HANDLE;
+	}
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(vkPhysicalDevice, &properties);
+	timestampPeriod = properties.limits.timestampPeriod;
+
+	VkQueryPoolCreateInfo createInfo{};
+	createInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	createInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	createInfo.queryCount = queryCount;
+
+	VkQueryPool queryPool;
+	if (vkCreateQueryPool(vkDevice, &createInfo, nullptr, &queryPool) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create timestamp query pool!");
+	}
+
+	return queryPool;
+}
+
+//GPU time between the timestamps at firstQuery and firstQuery + 1 in ms, empty while they are not available
+std::optional<double> readTimestampMs(const VkDevice& vkDevice, VkQueryPool queryPool, uint32_t firstQuery, float timestampPeriod)
+{
+	uint64_t ticks[2] = {};
+	if (vkGetQueryPoolResults(vkDevice, queryPool, firstQuery, 2, sizeof(ticks), ticks, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+	{
+		return std::nullopt;
+	}
+
+	return static_cast<double>(ticks[1] - ticks[0]) * timestampPeriod / 1e6;
+}
+
+static std::vector<char> readFile(const std::string& filename);
 
 class Engine
 {
 public:
-	VkDebugUtilsMessengerEXT debugMessenger;
-	GLFWwindow* window;
+	VkDebugUtilsMessengerEXT debugMessenger = VK_NULL_HANDLE;
+	GLFWwindow* window = nullptr; //null in headless runs
+	bool headless = false; //no window: the swapchain is created on a VK_EXT_headless_surface
 	VkInstance vkInstance;
-	VkPhysicalDevice vkPhysicalDevice;
+	VkPhysicalDevice vkPhysicalDevice = VK_NULL_HANDLE;
+	QueueFamilyIndices queueFamilyIndices; //queried once for the selected device
+	SwapChainDetails swapChainDetails; //queried once for the selected device
 	VkDevice vkDevice;
 	VkSurfaceKHR vkSurface;
 	VkQueue graphicsQueue, presentQueue;
@@ -79,15 +780,70 @@ public:
 	std::vector<VkImageView> swapChainImageViews;
 	std::vector<VkFramebuffer> swapChainFramebuffers;
 
-	VkPipelineLayout vkPipelineLayout;
-	VkPipeline vkGraphicsPipeline;
-	VkRenderPass vkRenderPass;
+	PipelineTarget pipelineTarget; //shader modules are kept for compiling variants later
+	VkPipeline vkGraphicsPipeline; //generic variant, always ready
+
+	//Specialized pipelines by key, compiled lazily on worker threads. Only the render thread touches the maps.
+	std::map<PipelineVariantKey, VkPipeline> readyVariants;
+	std::map<PipelineVariantKey, std::future<std::pair<VkPipeline, double>>> pendingVariants;
+	std::set<PipelineVariantKey> failedVariants; //never compiled again
+	PipelineVariantStats variantStats;
+	uint32_t pipelineSwaps = 0;
+	double pipelineSwapMs = 0.0; //render thread time spent replacing the generic pipeline
+	VkPipelineCache vkPipelineCache = VK_NULL_HANDLE; //persisted to pipelineCacheFile between runs
+	VkRenderPass vkRenderPass = VK_NULL_HANDLE;
 	VkCommandPool vkCommandPool;
-	VkCommandBuffer vkCommandBuffer;
 
-	VkSemaphore imageAvailableSemaphore;
-	VkSemaphore renderFinishedSemaphore;
-	VkFence inFlightFence;
+	//VK_KHR_dynamic_rendering: no render pass or framebuffer objects, attachments are given at record time
+	bool useDynamicRendering = false;
+	PFN_vkCmdBeginRenderingKHR pfnCmdBeginRendering = nullptr;
+	PFN_vkCmdEndRenderingKHR pfnCmdEndRendering = nullptr;
+
+	std::array<FrameData, MAX_FRAMES_IN_FLIGHT> frames;
+	uint32_t currentFrame = 0;
+
+	//Vulkan 1.2 timeline semaphore counting graphics queue submissions. Replaces the per-frame fences.
+	bool useTimelineSemaphore = false;
+	VkSemaphore graphicsTimeline = VK_NULL_HANDLE;
+	uint64_t graphicsSubmittedValue = 0; //value signaled by the latest submission
+	uint64_t graphicsCompletedValue = 0; //last value read back from the device
+
+	DeletionQueue deviceDeletionQueue; //objects that live until cleanup()
+	ObjectCounter liveObjects;
+	std::mutex lifetimeMutex; //startup registers objects from worker threads
+
+	StartupTimeline startup;
+
+	//Split-frame rendering across logical devices. bands[0] is the presenting device's, bands[i + 1] is peers[i]'s.
+	std::vector<PeerDevice> peers;
+	std::vector<RenderBand> bands;
+	VkQueryPool timestampPool = VK_NULL_HANDLE; //two queries per frame in flight, presenting device
+	float timestampPeriod = 1.0f;
+
+	//Scene records live in device local buffers, updated through each frame's staging buffer
+	Scene scene;
+	std::vector<uint32_t> sceneInstanceIds; //ids of the instances in the scene, by grid cell
+	SceneBuffer instanceBuffer;
+	SceneBuffer materialBuffer;
+	SceneBuffer lightBuffer;
+	SceneUploadStats sceneStats;
+
+	RunOptions options;
+	uint32_t frameCounter = 0;
+	bool captureThisFrame = false;
+	VkBuffer captureBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory captureBufferMemory = VK_NULL_HANDLE;
+	std::vector<double> frameTimesMs;
+
+	std::vector<ReadbackSlot> exportSlots;
+	ExportPool exportPool;
+	std::optional<uint32_t> exportSlotThisFrame; //slot the current frame is copied into
+	double exportStallMs = 0.0;
+	std::optional<std::chrono::steady_clock::time_point> exportStart; //first slot acquired, startup is not part of the export rate
+
+	std::optional<RenderJob> jobThisFrame; //server mode: read the current frame back as this job's result
+	uint32_t jobsServed = 0;
+	uint32_t variantSwitches = 0; //batches of jobs sharing a pipeline variant
 
 	void run();
 
@@ -114,9 +870,15 @@ public:
 private:
 
 	void renderLoop();
+	void serve();
+	void claimJobs(std::deque<RenderJob>& queue);
+	void failJob(const std::string& id, const std::string& message);
+	void finishFrames();
 	void cleanup();
 	void createWindow();
+	bool pollWindow();
 	void initVulkan();
+	void step(const std::string& name, const std::function<void()>& fn);
 	void createVInstance();
 	void createSurface();
 	void createPhysicalDevice();
@@ -124,834 +886,3898 @@ private:
 	void createSwapChain();
 	void createImageViews();
 	void createRenderPass();
-	void createGraphicsPipeline();
+	VkRenderPass buildRenderPass(VkDevice device, VkImageLayout finalLayout);
+	void createGraphicsPipeline(const ShaderCode& shaderCode);
+	VkPipeline buildGraphicsPipeline(const PipelineVariantKey& key, const PipelineTarget& target);
+	VkPipeline getPipelineVariant(const PipelineVariantKey& key);
+	void swapGenericPipeline();
+	void startVariantCompile(const PipelineVariantKey& key);
+	void collectVariantCompile(std::map<PipelineVariantKey, std::future<std::pair<VkPipeline, double>>>::iterator pending);
+	bool requestPipelineVariant(const PipelineVariantKey& key);
+	void createPipelineCache();
+	void savePipelineCache();
 	void createFramebuffers();
+	VkFramebuffer buildFramebuffer(VkDevice device, VkRenderPass renderPass, VkImageView imageView);
+	VkImageView buildImageView(VkDevice device, VkImage image, VkFormat format);
+	double measureRenderTargetRecreation(uint32_t iterations, bool withRenderPass);
 	void createCommandPool();
-	void createCommandBuffer();
-	void recordCommandBuffer(uint32_t imageIndex);
+	void createCommandBuffers();
+	void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex);
 	void createSyncObjects();
 	void drawFrame();
-};
 
+	bool isGraphicsWorkComplete(uint64_t value);
+	void waitForGraphicsWork(uint64_t value);
+	void releaseCompletedFrames();
+
+	void keepUntilCleanup(const std::string& type, std::function<void()>&& destroy);
+	void retire(const std::string& type, std::function<void()>&& destroy);
+
+	void createCaptureBuffer();
+	void recordCaptureCopy(VkCommandBuffer commandBuffer, uint32_t imageIndex, VkBuffer dstBuffer);
+	bool finishBenchmark();
+	void createExportRing();
+	void encodeExportSlot(uint32_t slot);
+	void finishExport();
+
+	void createPeerDevices(const ShaderCode& shaderCode);
+	void createPeerDevice(PeerDevice& peer, VkPhysicalDevice physicalDevice, const ShaderCode& shaderCode);
+	void keepUntilPeerCleanup(PeerDevice& peer, const std::string& type, std::function<void()>&& destroy);
+	VkPipeline getPeerPipeline(PeerDevice& peer, const PipelineVariantKey& key);
+	void renderPeerBands();
+	void collectPeerBands(FrameData& frame);
+	void recordComposite(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+	void balanceBands();
+
+	void populateScene();
+	void animateScene();
+	void churnScene();
+	bool reserveSceneBuffer(SceneBuffer& sceneBuffer, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties);
+	void releaseSceneBuffer(SceneBuffer& sceneBuffer);
+	void recordSceneUpload(VkCommandBuffer commandBuffer);
+};
 
-int main()
+//<sample count>,<bounce depth>,<feature bits>
+PipelineVariantKey parsePipelineVariant(const std::string& value)
 {
-	Engine vkEngine;
-
-	try {
-		vkEngine.run();
-	}
-	catch (const std::exception& e) {
-		std::cerr << e.what() << std::endl;
+	PipelineVariantKey key;
+	char separator1 = 0, separator2 = 0;
+	std::istringstream stream(value);
+	stream >> key.sampleCount >> separator1 >> key.bounceDepth >> separator2 >> key.featureBits;
+	if (!stream || separator1 != ',' || separator2 != ',')
+	{
+		throw std::runtime_error("variant expects <sample count>,<bounce depth>,<feature bits>, got " + value);
 	}
+	return key;
 }
 
-
-void Engine::run()
-{
-	createWindow();
-	initVulkan();
-
-	renderLoop();
-
-	cleanup();
-}
-
-void Engine::createSyncObjects() 
+RunOptions parseRunOptions(int argc, char** argv)
 {
-	VkSemaphoreCreateInfo semaphoreInfo{};
-	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-
-	VkFenceCreateInfo fenceInfo{};
-	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-	fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+	RunOptions options;
 
-	if (vkCreateSemaphore(vkDevice, &semaphoreInfo, nullptr, &imageAvailableSemaphore) != VK_SUCCESS ||
-		vkCreateSemaphore(vkDevice, &semaphoreInfo, nullptr, &renderFinishedSemaphore) != VK_SUCCESS ||
-		vkCreateFence(vkDevice, &fenceInfo, nullptr, &inFlightFence) != VK_SUCCESS) {
-		throw std::runtime_error("failed to create synchronization objects for a frame!");
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--render-pass")
+		{
+			options.forceRenderPass = true;
+			continue;
+		}
+		if (arg == "--headless")
+		{
+			options.forceHeadless = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			throw std::runtime_error("Missing value for option " + arg);
+		}
+		std::string value = argv[++i];
+
+		if (arg == "--frames") options.frameCount = static_cast<uint32_t>(std::stoul(value));
+		else if (arg == "--scene") options.scene = value;
+		else if (arg == "--capture") options.capturePath = value;
+		else if (arg == "--golden") options.goldenPath = value;
+		else if (arg == "--tolerance") options.tolerance = std::stod(value);
+		else if (arg == "--history") options.historyPath = value;
+		else if (arg == "--max-slowdown") options.maxSlowdown = std::stod(value);
+		else if (arg == "--export") options.exportPrefix = value;
+		else if (arg == "--export-format") options.exportFormat = value;
+		else if (arg == "--export-threads") options.exportThreads = static_cast<uint32_t>(std::stoul(value));
+		else if (arg == "--instances") options.sceneInstances = static_cast<uint32_t>(std::stoul(value));
+		else if (arg == "--moving") options.movingInstances = static_cast<uint32_t>(std::stoul(value));
+		else if (arg == "--churn") options.churnInstances = static_cast<uint32_t>(std::stoul(value));
+		else if (arg == "--swap-pipeline") options.pipelineSwapInterval = static_cast<uint32_t>(std::stoul(value));
+		else if (arg == "--mesh") options.meshRings = static_cast<uint32_t>(std::stoul(value));
+		else if (arg == "--lights") options.sceneLights = static_cast<uint32_t>(std::stoul(value));
+		else if (arg == "--devices") options.deviceCount = static_cast<uint32_t>(std::stoul(value));
+		else if (arg == "--variant") options.variant = parsePipelineVariant(value);
+		else if (arg == "--serve") options.serveDirectory = value;
+		else if (arg == "--load-test") options.loadTestDirectory = value;
+		else if (arg == "--jobs") options.loadTestJobs = static_cast<uint32_t>(std::stoul(value));
+		else if (arg == "--concurrency") options.loadTestConcurrency = static_cast<uint32_t>(std::stoul(value));
+		else throw std::runtime_error("Unknown option " + arg);
 	}
 
-}
-
-void Engine::drawFrame()
-{
-	vkWaitForFences(vkDevice, 1, &inFlightFence, VK_TRUE, UINT64_MAX);
-	vkResetFences(vkDevice, 1, &inFlightFence);
-
-	uint32_t imageIndex;
-	vkAcquireNextImageKHR(vkDevice, vkSwapChain, UINT64_MAX, imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
-
-	vkResetCommandBuffer(vkCommandBuffer, /*VkCommandBufferResetFlagBits*/ 0);
-	recordCommandBuffer(imageIndex);
-
-	VkSubmitInfo submitInfo{};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-
-	VkSemaphore waitSemaphores[] = { imageAvailableSemaphore };
-	VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = waitSemaphores;
-	submitInfo.pWaitDstStageMask = waitStages;
-
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &vkCommandBuffer;
+	if ((options.needsCapture() || options.needsExport() || !options.historyPath.empty()) && !options.isBenchmark())
+	{
+		throw std::runtime_error("--capture, --golden, --export and --history need --frames.");
+	}
 
-	VkSemaphore signalSemaphores[] = { renderFinishedSemaphore };
-	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = signalSemaphores;
+	if (options.meshRings > 0 && !options.isBenchmark())
+	{
+		throw std::runtime_error("--mesh needs --frames.");
+	}
 
-	if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFence) != VK_SUCCESS) {
-		throw std::runtime_error("failed to submit draw command buffer!");
+	if (options.forceHeadless && !options.isBenchmark() && !options.isServer())
+	{
+		throw std::runtime_error("--headless needs --frames or --serve.");
 	}
 
-	VkPresentInfoKHR presentInfo{};
-	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+	if (options.isServer() && options.isBenchmark())
+	{
+		throw std::runtime_error("--serve runs until it is shut down and cannot be combined with --frames.");
+	}
 
-	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = signalSemaphores;
+	if (!options.loadTestDirectory.empty() && (options.loadTestJobs == 0 || options.loadTestConcurrency == 0))
+	{
+		throw std::runtime_error("--load-test needs at least one job and a concurrency of at least one.");
+	}
 
-	VkSwapchainKHR swapChains[] = { vkSwapChain };
-	presentInfo.swapchainCount = 1;
-	presentInfo.pSwapchains = swapChains;
+	if (options.deviceCount == 0)
+	{
+		throw std::runtime_error("--devices needs at least the presenting device.");
+	}
 
-	presentInfo.pImageIndices = &imageIndex;
+	if (options.exportFormat != "ppm" && options.exportFormat != "raw")
+	{
+		throw std::runtime_error("Unknown export format " + options.exportFormat);
+	}
 
-	vkQueuePresentKHR(presentQueue, &presentInfo);
+	return options;
 }
 
-void Engine::renderLoop()
+//key=value lines: variant=<s>,<b>,<f>, frames=<n>, format=ppm|raw. Missing keys keep their defaults.
+void parseRenderJob(const std::filesystem::path& path, RenderJob& job)
 {
-	while (!glfwWindowShouldClose(window)) 
+	std::ifstream file(path);
+	if (!file.is_open())
 	{
-		glfwPollEvents();
-		drawFrame();
+		throw std::runtime_error("failed to open " + path.string() + "!");
 	}
-}
-
-void Engine::createWindow()
-{
-	glfwInit();
-	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-	glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
-	window = glfwCreateWindow(WIDTH, HEIGHT, "Triangle", nullptr, nullptr);
-
-}
 
-void Engine::initVulkan()
-{
-	createVInstance();
-	setupDebugMessenger();
-	createSurface(); //Inits vkSurface
-	createPhysicalDevice(); //Inits vkPhysicalDevice
-	createDevice(); //Inits vkDevice, Queues - graphicsQueue, presentQueue
-	createSwapChain(); //Inits vkSwapChain, swapChainImages
-	createImageViews(); //Inits swapChainImageView
-	createRenderPass();
-	createGraphicsPipeline();
-	createFramebuffers();
-	createCommandPool();
-	createCommandBuffer();
-	createSyncObjects();
-}
+	std::string line;
+	while (std::getline(file, line))
+	{
+		size_t separator = line.find('=');
+		if (line.empty() || separator == std::string::npos)
+		{
+			continue;
+		}
+		std::string key = line.substr(0, separator);
+		std::string value = line.substr(separator + 1);
 
+		if (key == "variant") job.variant = parsePipelineVariant(value);
+		else if (key == "frames") job.frames = static_cast<uint32_t>(std::stoul(value));
+		else if (key == "format") job.format = value;
+		else throw std::runtime_error("Unknown job key " + key);
+	}
 
-void Engine::cleanup()
-{
-	vkDestroyCommandPool(vkDevice, vkCommandPool, nullptr);
-	
-	for (auto framebuffer : swapChainFramebuffers) 
+	if (job.frames == 0)
 	{
-		vkDestroyFramebuffer(vkDevice, framebuffer, nullptr);
+		throw std::runtime_error("A job needs at least one frame.");
 	}
-
-	vkDestroyPipeline(vkDevice, vkGraphicsPipeline, nullptr);
-	vkDestroyPipelineLayout(vkDevice, vkPipelineLayout, nullptr);
-	vkDestroyRenderPass(vkDevice, vkRenderPass, nullptr);
-	for (auto imageView : swapChainImageViews) 
+	if (job.format != "ppm" && job.format != "raw")
 	{
-		vkDestroyImageView(vkDevice, imageView, nullptr);
+		throw std::runtime_error("Unknown export format " + job.format);
 	}
-	vkDestroySwapchainKHR(vkDevice, vkSwapChain, nullptr);
-	vkDestroyDevice(vkDevice, nullptr);
-	vkDestroySurfaceKHR(vkInstance, vkSurface, nullptr);
-	vkDestroyInstance(vkInstance, nullptr);
-	glfwDestroyWindow(window);
-	glfwTerminate();
 }
 
-bool checkValidationLayerSupport(std::set<const char*> requiredLayers)
+//Client side of server mode, no Vulkan needed. Keeps loadTestConcurrency jobs outstanding and times each
+//one from submission until its .done marker appears. Jobs cycle through three sample counts, so the
+//server has to batch by variant.
+void runLoadTest(const RunOptions& options)
 {
-	uint32_t count = 0;
-	vkEnumerateInstanceLayerProperties(&count, nullptr);
+	namespace fs = std::filesystem;
+	fs::path directory(options.loadTestDirectory);
+	fs::create_directories(directory);
+
+	//Unique per run, zero padded so the server's name order is the submission order
+	std::string run = std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+	auto jobId = [&](uint32_t index) {
+		std::string number = std::to_string(index);
+		return "load" + run + "_" + std::string(number.size() < 6 ? 6 - number.size() : 0, '0') + number;
+	};
 
-	std::vector<VkLayerProperties> availableLayers(count);
-	vkEnumerateInstanceLayerProperties(&count, availableLayers.data());
+	std::map<std::string, std::chrono::steady_clock::time_point> outstanding;
+	std::vector<double> latenciesMs;
+	uint32_t submitted = 0;
+	auto start = std::chrono::steady_clock::now();
+	auto lastProgress = start;
 
-	for (const auto& layers : availableLayers)
+	while (latenciesMs.size() < options.loadTestJobs)
 	{
-		auto itr = requiredLayers.find(layers.layerName);
-		if (itr != requiredLayers.end())
+		//1. Top up to the concurrency limit. Jobs are written under a temporary name and renamed,
+		//   so the server never reads half a file.
+		while (outstanding.size() < options.loadTestConcurrency && submitted < options.loadTestJobs)
 		{
-			requiredLayers.erase(itr);
+			std::string id = jobId(submitted);
+			PipelineVariantKey variant = options.variant;
+			variant.sampleCount = 1u << (submitted % 3);
+			{
+				std::ofstream file(directory / (id + ".tmp"));
+				file << "variant=" << variant.sampleCount << "," << variant.bounceDepth << "," << variant.featureBits << "\n";
+				file << "frames=1\n";
+				file << "format=" << options.exportFormat << "\n";
+			}
+			fs::rename(directory / (id + ".tmp"), directory / (id + ".job"));
+			outstanding[id] = std::chrono::steady_clock::now();
+			submitted++;
+		}
+
+		//2. Collect finished jobs and remove their results
+		for (auto it = outstanding.begin(); it != outstanding.end();)
+		{
+			if (fs::exists(directory / (it->first + ".failed")))
+			{
+				throw std::runtime_error("Job " + it->first + " failed on the server.");
+			}
+			if (!fs::exists(directory / (it->first + ".done")))
+			{
+				it++;
+				continue;
+			}
+			auto now = std::chrono::steady_clock::now();
+			latenciesMs.push_back(std::chrono::duration<double, std::milli>(now - it->second).count());
+			lastProgress = now;
+			fs::remove(directory / (it->first + ".done"));
+			fs::remove(directory / (it->first + "." + options.exportFormat));
+			it = outstanding.erase(it);
+		}
+
+		if (std::chrono::steady_clock::now() - lastProgress > std::chrono::seconds(30))
+		{
+			throw std::runtime_error("No job finished for 30 s, is a server watching " + directory.string() + "?");
 		}
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
 	}
 
-	return requiredLayers.empty();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::sort(latenciesMs.begin(), latenciesMs.end());
+	auto percentile = [&](double p) {
+		size_t rank = static_cast<size_t>(std::ceil(p * latenciesMs.size()));
+		return latenciesMs[std::clamp<size_t>(rank, 1, latenciesMs.size()) - 1];
+	};
 
+	std::cout << "load test: " << latenciesMs.size() << " jobs in " << seconds << " s (" << latenciesMs.size() / seconds
+		<< " jobs/s) at concurrency " << options.loadTestConcurrency << std::endl;
+	std::cout << "load test: latency p50 " << percentile(0.50) << " ms, p95 " << percentile(0.95) << " ms, p99 "
+		<< percentile(0.99) << " ms, max " << latenciesMs.back() << " ms" << std::endl;
 }
 
-std::vector<const char*> getInstanceLevelExtensions()
+int main(int argc, char** argv)
 {
-	const char** glfwExtensions;
-	uint32_t count = 0;
-
-	glfwExtensions = glfwGetRequiredInstanceExtensions(&count);
-
-	std::vector<const char*> requiredExtensions(glfwExtensions, glfwExtensions + count);
-
-	//Enable vulkan debugging
-	requiredExtensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+	Engine vkEngine;
 
-	return requiredExtensions;
+	try {
+		vkEngine.options = parseRunOptions(argc, argv);
+		if (!vkEngine.options.loadTestDirectory.empty())
+		{
+			runLoadTest(vkEngine.options);
+			return EXIT_SUCCESS;
+		}
+		vkEngine.run();
+	}
+	catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
 
+	return EXIT_SUCCESS;
 }
 
-void Engine::createVInstance()
+
+void Engine::run()
 {
-	VkApplicationInfo appInfo = {};
-	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
-	appInfo.pApplicationName = "Basic_Triangle_Renderer";
-	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
-	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-	appInfo.pEngineName = "Purva_Engine";
-	appInfo.apiVersion = VK_API_VERSION_1_0;
+	startup.origin = std::chrono::steady_clock::now();
 
-	VkInstanceCreateInfo createInfo = {}; //Either set 0 or initialize every member.
-	createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-	createInfo.pApplicationInfo = &appInfo;
-	
-	//Check and enable validation layer support
-	std::set<const char*> requiredLayers(validationLayers.begin(), validationLayers.end());
-	if (checkValidationLayerSupport(requiredLayers))
+	step("createWindow", [this]() { createWindow(); });
+	initVulkan();
+
+	if (options.isServer())
 	{
-		createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
-		createInfo.ppEnabledLayerNames = validationLayers.data();
+		serve();
 	}
 	else
 	{
-		createInfo.enabledLayerCount = static_cast<uint32_t>(0);
-		createInfo.ppEnabledLayerNames = nullptr;
+		renderLoop();
 	}
 
-	std::vector<const char*> requiredExtensions = getInstanceLevelExtensions();
+	if (options.needsExport() || options.isServer())
+	{
+		finishExport();
+	}
 
-	//Enable instance level extensions
-	createInfo.enabledExtensionCount = static_cast<uint32_t>(requiredExtensions.size());
-	createInfo.ppEnabledExtensionNames = requiredExtensions.data();
-	
+	bool passed = true;
+	if (options.isBenchmark())
+	{
+		passed = finishBenchmark();
+	}
 
-	if (vkCreateInstance(&createInfo, nullptr, &vkInstance) != VK_SUCCESS) {
-		throw std::runtime_error("Instance creation failed.");
+	cleanup();
+
+	//Scripted runs also fail on leaked device objects
+	if (options.isBenchmark() && liveObjects.leaked() != 0)
+	{
+		passed = false;
 	}
-}
 
-void Engine::createSurface()
-{
-	if (glfwCreateWindowSurface(vkInstance, window, nullptr, &vkSurface) != VK_SUCCESS)
+	if (!passed)
 	{
-		throw std::runtime_error("Surface creation failed!");
+		throw std::runtime_error("Benchmark run failed: regression detected.");
 	}
 }
 
-QueueFamilyIndices getQueueFamilyIndices(const VkPhysicalDevice& vkPhysicalDevice, const VkSurfaceKHR& vkSurface)
+void Engine::createSyncObjects() 
 {
-	uint32_t reqQueueFamilyCount = 0;
-	std::vector<VkQueueFamilyProperties> reqQueueFamilyProps;
-
-	vkGetPhysicalDeviceQueueFamilyProperties(vkPhysicalDevice, &reqQueueFamilyCount, nullptr);
+	VkSemaphoreCreateInfo semaphoreInfo{};
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-	if (reqQueueFamilyCount > 0)
-	{
-		reqQueueFamilyProps.resize(reqQueueFamilyCount);
-		vkGetPhysicalDeviceQueueFamilyProperties(vkPhysicalDevice, &reqQueueFamilyCount, reqQueueFamilyProps.data());
-	}
-	QueueFamilyIndices indices;
+	VkFenceCreateInfo fenceInfo{};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-	int index = 0;
-	for (auto& queueFamilyProp : reqQueueFamilyProps)
+	//Swapchain acquire and present only take binary semaphores, so those stay per frame
+	for (auto& frame : frames)
 	{
-		if (queueFamilyProp.queueFlags & VK_QUEUE_GRAPHICS_BIT)
-		{
-			indices.graphicsFamilyIndex = index;
+		if (vkCreateSemaphore(vkDevice, &semaphoreInfo, nullptr, &frame.imageAvailableSemaphore) != VK_SUCCESS ||
+			vkCreateSemaphore(vkDevice, &semaphoreInfo, nullptr, &frame.renderFinishedSemaphore) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create synchronization objects for a frame!");
 		}
 
-		VkBool32 isExistPresentFamily = false;
-
-		vkGetPhysicalDeviceSurfaceSupportKHR(vkPhysicalDevice, index, vkSurface, &isExistPresentFamily);
+		VkSemaphore imageAvailable = frame.imageAvailableSemaphore;
+		VkSemaphore renderFinished = frame.renderFinishedSemaphore;
+		keepUntilCleanup("VkSemaphore", [this, imageAvailable]() { vkDestroySemaphore(vkDevice, imageAvailable, nullptr); });
+		keepUntilCleanup("VkSemaphore", [this, renderFinished]() { vkDestroySemaphore(vkDevice, renderFinished, nullptr); });
 
-		if (isExistPresentFamily)
+		if (!useTimelineSemaphore)
 		{
-			indices.presentFamilyIndex = index;
+			if (vkCreateFence(vkDevice, &fenceInfo, nullptr, &frame.inFlightFence) != VK_SUCCESS) {
+				throw std::runtime_error("failed to create synchronization objects for a frame!");
+			}
+			VkFence inFlight = frame.inFlightFence;
+			keepUntilCleanup("VkFence", [this, inFlight]() { vkDestroyFence(vkDevice, inFlight, nullptr); });
 		}
-
-		if (indices.isComplete()) break;
-		index++;
 	}
 
-	return indices;
-}
+	//One timeline for the graphics queue replaces every fence. Value 0 means "nothing submitted yet".
+	if (useTimelineSemaphore)
+	{
+		VkSemaphoreTypeCreateInfo typeInfo{};
+		typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+		typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+		typeInfo.initialValue = 0;
 
-SwapChainDetails getSwapChainDetails(const VkPhysicalDevice &vkPhysicalDevice, const VkSurfaceKHR &vkSurface)
-{
-	SwapChainDetails details;
-	//1. Get available surface capabilities
-	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(vkPhysicalDevice, vkSurface, &details.surfaceCapabilities);
+		VkSemaphoreCreateInfo timelineInfo{};
+		timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		timelineInfo.pNext = &typeInfo;
 
-	//2. Get available formats
-	uint32_t formatCount = 0;
-	vkGetPhysicalDeviceSurfaceFormatsKHR(vkPhysicalDevice, vkSurface, &formatCount, nullptr);
-	if (formatCount > 0)
-	{
-		details.formats.resize(formatCount);
-		vkGetPhysicalDeviceSurfaceFormatsKHR(vkPhysicalDevice, vkSurface, &formatCount, details.formats.data());
+		if (vkCreateSemaphore(vkDevice, &timelineInfo, nullptr, &graphicsTimeline) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create graphics timeline semaphore!");
+		}
+		VkSemaphore timeline = graphicsTimeline;
+		keepUntilCleanup("VkSemaphore", [this, timeline]() { vkDestroySemaphore(vkDevice, timeline, nullptr); });
 	}
+}
 
-	//3. Get available present modes
-	uint32_t presentModeCount = 0;
-	vkGetPhysicalDeviceSurfacePresentModesKHR(vkPhysicalDevice, vkSurface, &presentModeCount, nullptr);
-	if (presentModeCount > 0)
+//Compares against the cached completed value first and only asks the device when that is not enough
+bool Engine::isGraphicsWorkComplete(uint64_t value)
+{
+	if (value <= graphicsCompletedValue)
 	{
-		details.presentModes.resize(presentModeCount);
-		vkGetPhysicalDeviceSurfacePresentModesKHR(vkPhysicalDevice, vkSurface, &presentModeCount, details.presentModes.data());
+		return true;
 	}
 
-	return details;
+	vkGetSemaphoreCounterValue(vkDevice, graphicsTimeline, &graphicsCompletedValue);
+	return value <= graphicsCompletedValue;
 }
 
-bool checkDeviceLevelExtensions(const VkPhysicalDevice& vkPhysicalDevice)
+void Engine::waitForGraphicsWork(uint64_t value)
 {
-	uint32_t count;
-	vkEnumerateDeviceExtensionProperties(vkPhysicalDevice, nullptr, &count, nullptr);
-	std::vector<VkExtensionProperties> availableExtensions(count);
-	vkEnumerateDeviceExtensionProperties(vkPhysicalDevice, nullptr, &count, availableExtensions.data());
-
-	std::set<std::string> requiredExtensions(device_extensions.begin(), device_extensions.end());
-
-	for (const auto &extension : availableExtensions)
+	if (isGraphicsWorkComplete(value))
 	{
-		requiredExtensions.erase(extension.extensionName);
+		return;
 	}
 
-	return requiredExtensions.empty();
-}
-
-bool isDeviceSuitable(const VkPhysicalDevice& vkPhysicalDevice, const VkSurfaceKHR &vkSurface)
-{
-	//1. Check if supports queue families
-	QueueFamilyIndices indices = getQueueFamilyIndices(vkPhysicalDevice, vkSurface);
-	
-	//2. Check if supports device level extensions
-	bool isExtenionSupported = checkDeviceLevelExtensions(vkPhysicalDevice);
-	
-	//3. Check if has swap chain support
-	SwapChainDetails details = getSwapChainDetails(vkPhysicalDevice, vkSurface);
-	bool isSwapChainSupport = details.formats.size() > 0 && details.presentModes.size() > 0;
+	VkSemaphoreWaitInfo waitInfo{};
+	waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &graphicsTimeline;
+	waitInfo.pValues = &value;
 
-	return indices.isComplete() && isExtenionSupported && isSwapChainSupport;
+	if (vkWaitSemaphores(vkDevice, &waitInfo, UINT64_MAX) != VK_SUCCESS) {
+		throw std::runtime_error("failed to wait for the graphics timeline!");
+	}
+	graphicsCompletedValue = std::max(graphicsCompletedValue, value);
 }
 
-void Engine::createPhysicalDevice()
+//Non-blocking pass over the frames in flight: a frame whose work is done frees its retired objects and hands
+//its readback slot to the encoders right away, instead of when its slot is waited on again. Only called
+//between frames, when every slot's value (or fence) belongs to its latest submission.
+void Engine::releaseCompletedFrames()
 {
-	uint32_t count = 0;
-	vkEnumeratePhysicalDevices(vkInstance, &count, nullptr);
-	std::vector<VkPhysicalDevice> availableDevices(count);
-	vkEnumeratePhysicalDevices(vkInstance, &count, availableDevices.data());
-
-	for (auto physicalDevice : availableDevices)
+	for (auto& frame : frames)
 	{
-		if (isDeviceSuitable(physicalDevice, vkSurface))
+		bool complete = useTimelineSemaphore ? isGraphicsWorkComplete(frame.timelineValue)
+			: vkGetFenceStatus(vkDevice, frame.inFlightFence) == VK_SUCCESS;
+		if (!complete)
 		{
-			vkPhysicalDevice = physicalDevice;
+			continue;
 		}
-	}
 
-	if (vkPhysicalDevice == VK_NULL_HANDLE)
-	{
-		throw std::runtime_error("Could not find GPU.");
+		frame.deletionQueue.flush();
+		if (frame.exportSlot)
+		{
+			exportPool.push(*frame.exportSlot);
+			frame.exportSlot.reset();
+		}
 	}
-
+}
+
+void Engine::keepUntilCleanup(const std::string& type, std::function<void()>&& destroy)
+{
+	std::lock_guard<std::mutex> lock(lifetimeMutex);
+	liveObjects.created(type);
+	deviceDeletionQueue.push([this, type, destroy]() {
+		destroy();
+		liveObjects.destroyed(type);
+	});
+}
+
+//For objects replaced at runtime: the caller already counted the creation. The current frame is
+//the last one that can reference the object, so destroying it once that frame's work is done is safe
+//without waiting for the whole device.
+void Engine::retire(const std::string& type, std::function<void()>&& destroy)
+{
+	frames[currentFrame].deletionQueue.push([this, type, destroy]() {
+		destroy();
+		liveObjects.destroyed(type);
+	});
+}
+
+void Engine::drawFrame()
+{
+	//Only the last frame of a scripted run is read back
+	captureThisFrame = options.needsCapture() && frameCounter + 1 == options.frameCount;
+
+	FrameData& frame = frames[currentFrame];
+
+	if (useTimelineSemaphore)
+	{
+		waitForGraphicsWork(frame.timelineValue);
+	}
+	else
+	{
+		vkWaitForFences(vkDevice, 1, &frame.inFlightFence, VK_TRUE, UINT64_MAX);
+		vkResetFences(vkDevice, 1, &frame.inFlightFence);
+	}
+
+	//Everything this frame slot used last time round is finished now
+	frame.deletionQueue.flush();
+
+	//Its queries timed the presenting device's band last time round
+	if (frame.timedRows > 0)
+	{
+		std::optional<double> bandMs = readTimestampMs(vkDevice, timestampPool, currentFrame * 2, timestampPeriod);
+		if (bandMs)
+		{
+			bands[0].addSample(*bandMs, frame.timedRows);
+		}
+		frame.timedRows = 0;
+	}
+
+	//Its copy has landed too, encode it while this frame renders
+	if (frame.exportSlot)
+	{
+		exportPool.push(*frame.exportSlot);
+		frame.exportSlot.reset();
+	}
+
+	//Peers hand over last frame's bands and start on this frame's before anything else can block
+	if (!peers.empty())
+	{
+		collectPeerBands(frame);
+		renderPeerBands();
+	}
+
+	if (options.needsExport() || jobThisFrame)
+	{
+		uint32_t slot = frameCounter % static_cast<uint32_t>(exportSlots.size());
+		if (!exportStart)
+		{
+			exportStart = std::chrono::steady_clock::now();
+		}
+		exportStallMs += exportPool.acquire(slot);
+		exportSlots[slot].frameIndex = frameCounter;
+		exportSlots[slot].job = jobThisFrame;
+		exportSlotThisFrame = slot;
+	}
+
+	uint32_t imageIndex;
+	vkAcquireNextImageKHR(vkDevice, vkSwapChain, UINT64_MAX, frame.imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
+
+	if (options.movingInstances > 0)
+	{
+		animateScene();
+	}
+
+	if (options.churnInstances > 0)
+	{
+		churnScene();
+	}
+
+	if (options.pipelineSwapInterval > 0 && frameCounter % options.pipelineSwapInterval == options.pipelineSwapInterval - 1)
+	{
+		swapGenericPipeline();
+	}
+
+	vkResetCommandBuffer(frame.commandBuffer, /*VkCommandBufferResetFlagBits*/ 0);
+	recordCommandBuffer(frame.commandBuffer, imageIndex);
+
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+
+	VkSemaphore waitSemaphores[] = { frame.imageAvailableSemaphore };
+	VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
+	submitInfo.waitSemaphoreCount = 1;
+	submitInfo.pWaitSemaphores = waitSemaphores;
+	submitInfo.pWaitDstStageMask = waitStages;
+
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &frame.commandBuffer;
+
+	VkSemaphore signalSemaphores[] = { frame.renderFinishedSemaphore, graphicsTimeline };
+	submitInfo.signalSemaphoreCount = useTimelineSemaphore ? 2 : 1;
+	submitInfo.pSignalSemaphores = signalSemaphores;
+
+	//Values for binary semaphores are ignored
+	uint64_t waitValues[] = { 0 };
+	uint64_t signalValues[] = { 0, graphicsSubmittedValue + 1 };
+	VkTimelineSemaphoreSubmitInfo timelineInfo{};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.waitSemaphoreValueCount = 1;
+	timelineInfo.pWaitSemaphoreValues = waitValues;
+	timelineInfo.signalSemaphoreValueCount = 2;
+	timelineInfo.pSignalSemaphoreValues = signalValues;
+	if (useTimelineSemaphore)
+	{
+		submitInfo.pNext = &timelineInfo;
+	}
+
+	if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, frame.inFlightFence) != VK_SUCCESS) {
+		throw std::runtime_error("failed to submit draw command buffer!");
+	}
+
+	if (useTimelineSemaphore)
+	{
+		frame.timelineValue = ++graphicsSubmittedValue;
+	}
+
+	frame.exportSlot = exportSlotThisFrame;
+	exportSlotThisFrame.reset();
+
+	VkPresentInfoKHR presentInfo{};
+	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+
+	presentInfo.waitSemaphoreCount = 1;
+	presentInfo.pWaitSemaphores = signalSemaphores;
+
+	VkSwapchainKHR swapChains[] = { vkSwapChain };
+	presentInfo.swapchainCount = 1;
+	presentInfo.pSwapchains = swapChains;
+
+	presentInfo.pImageIndices = &imageIndex;
+
+	vkQueuePresentKHR(presentQueue, &presentInfo);
+
+	if (frameCounter == 0 && options.isBenchmark())
+	{
+		std::cout << "startup: first frame presented at " << startup.now() << " ms" << std::endl;
+	}
+
+	//Rebalance every few frames so band sizes follow the smoothed timings instead of per frame noise
+	if (!peers.empty() && frameCounter % 16 == 15)
+	{
+		balanceBands();
+	}
+	frameCounter++;
+	currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+
+	releaseCompletedFrames();
+}
+
+void Engine::renderLoop()
+{
+	while (pollWindow())
+	{
+
+		auto frameStart = std::chrono::steady_clock::now();
+		drawFrame();
+		auto frameEnd = std::chrono::steady_clock::now();
+
+		if (options.isBenchmark())
+		{
+			frameTimesMs.push_back(std::chrono::duration<double, std::milli>(frameEnd - frameStart).count());
+			if (frameCounter >= options.frameCount) break;
+		}
+	}
+
+	finishFrames();
+}
+
+//Let the GPU finish before reading back results or destroying anything
+void Engine::finishFrames()
+{
+	vkDeviceWaitIdle(vkDevice);
+
+	for (auto& frame : frames)
+	{
+		if (frame.exportSlot)
+		{
+			exportPool.push(*frame.exportSlot);
+			frame.exportSlot.reset();
+		}
+	}
+}
+
+//Server mode: instance, device, pipelines and readback ring stay loaded, so a job only costs its own
+//frames. Consecutive jobs overlap like any other frames in flight, and each result is encoded by the
+//export pool while later jobs render. Jobs are claimed by renaming <id>.job to <id>.claimed; results are
+//<id>.<format> followed by <id>.done. A "shutdown" file stops the server once no job is left and is
+//removed, so the next server on the directory starts normally.
+void Engine::serve()
+{
+	namespace fs = std::filesystem;
+	std::deque<RenderJob> queue;
+	PipelineVariantKey boundVariant = options.variant;
+	fs::create_directories(options.serveDirectory);
+	std::cout << "serving jobs from " << options.serveDirectory << std::endl;
+
+	while (pollWindow())
+	{
+		claimJobs(queue);
+
+		if (queue.empty())
+		{
+			//The last jobs' frames finish while the server is idle, publish them without waiting for new work
+			releaseCompletedFrames();
+			if (fs::remove(fs::path(options.serveDirectory) / "shutdown"))
+			{
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		//1. Jobs whose variant failed to compile are answered right away
+		for (auto it = queue.begin(); it != queue.end();)
+		{
+			if (failedVariants.count(it->variant) == 0)
+			{
+				it++;
+				continue;
+			}
+			failJob(it->id, "pipeline variant failed to compile");
+			it = queue.erase(it);
+		}
+		if (queue.empty())
+		{
+			continue;
+		}
+
+		//2. Every queued variant starts compiling. Of the jobs whose pipeline is ready, those on the bound
+		//   variant go first, so compatible jobs run back to back.
+		auto next = queue.end();
+		for (auto it = queue.begin(); it != queue.end(); it++)
+		{
+			if (!requestPipelineVariant(it->variant))
+			{
+				continue;
+			}
+			if (it->variant == boundVariant)
+			{
+				next = it;
+				break;
+			}
+			if (next == queue.end())
+			{
+				next = it;
+			}
+		}
+
+		//3. Nothing can run yet: wait for the oldest job's compile instead of drawing it with the fallback.
+		//   A compile that just failed has no future left, its jobs are answered on the next pass.
+		if (next == queue.end())
+		{
+			auto pending = pendingVariants.find(queue.front().variant);
+			if (pending != pendingVariants.end())
+			{
+				pending->second.wait();
+			}
+			continue;
+		}
+
+		RenderJob job = *next;
+		queue.erase(next);
+		if (!(job.variant == boundVariant) || jobsServed == 0)
+		{
+			variantSwitches++;
+		}
+		options.variant = boundVariant = job.variant;
+
+		//4. Only the job's last frame is read back
+		for (uint32_t i = 0; i < job.frames; i++)
+		{
+			if (i + 1 == job.frames)
+			{
+				jobThisFrame = job;
+			}
+			drawFrame();
+		}
+		jobThisFrame.reset();
+		jobsServed++;
+		releaseCompletedFrames();
+	}
+
+	finishFrames();
+}
+
+//Moves every new job file into the queue, oldest name first
+void Engine::claimJobs(std::deque<RenderJob>& queue)
+{
+	namespace fs = std::filesystem;
+	std::vector<fs::path> found;
+	for (const auto& entry : fs::directory_iterator(options.serveDirectory))
+	{
+		if (entry.path().extension() == ".job")
+		{
+			found.push_back(entry.path());
+		}
+	}
+	std::sort(found.begin(), found.end());
+
+	for (const auto& path : found)
+	{
+		//The rename is the claim: it fails if another server got there first
+		fs::path claimed = path;
+		claimed.replace_extension(".claimed");
+		std::error_code error;
+		fs::rename(path, claimed, error);
+		if (error)
+		{
+			continue;
+		}
+
+		RenderJob job;
+		job.id = path.stem().string();
+		try
+		{
+			parseRenderJob(claimed, job);
+		}
+		catch (const std::exception& e)
+		{
+			failJob(job.id, e.what());
+			continue;
+		}
+		job.claimed = std::chrono::steady_clock::now();
+		queue.push_back(job);
+	}
+}
+
+//Answers a claimed job with <id>.failed instead of a result
+void Engine::failJob(const std::string& id, const std::string& message)
+{
+	namespace fs = std::filesystem;
+	fs::path directory(options.serveDirectory);
+	std::ofstream(directory / (id + ".failed")) << message << std::endl;
+	fs::remove(directory / (id + ".claimed"));
+}
+
+void Engine::createWindow()
+{
+	//Scripted runs and servers render into a hidden window so they can run unattended. Without a display
+	//server (CI machines) they fall back to a headless surface.
+	bool unattended = options.isBenchmark() || options.isServer();
+	if (options.forceHeadless)
+	{
+		headless = true;
+		return;
+	}
+
+	if (glfwInit() == GLFW_FALSE)
+	{
+		if (!unattended)
+		{
+			throw std::runtime_error("failed to initialize GLFW!");
+		}
+		headless = true;
+		return;
+	}
+	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+	glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+	if (unattended)
+	{
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	}
+	window = glfwCreateWindow(WIDTH, HEIGHT, "Triangle", nullptr, nullptr);
+
+	if (window == nullptr)
+	{
+		if (!unattended)
+		{
+			throw std::runtime_error("failed to create window!");
+		}
+		headless = true;
+	}
+}
+
+//Handles window events. False once the window is closed; a headless run has no window to close.
+bool Engine::pollWindow()
+{
+	if (window == nullptr)
+	{
+		return true;
+	}
+	glfwPollEvents();
+	return !glfwWindowShouldClose(window);
+}
+
+void Engine::step(const std::string& name, const std::function<void()>& fn)
+{
+	startup.measure(name, fn);
+}
+
+//Startup as a small task graph. Independent work runs on worker threads:
+//  shader files are read while the instance and device are created,
+//  the pipeline is built once the swapchain format (and render pass) exist, while the main
+//  thread creates framebuffers, command buffers, sync objects and readback buffers.
+void Engine::initVulkan()
+{
+	std::future<ShaderCode> shaderCode = std::async(std::launch::async, [this]() {
+		ShaderCode code;
+		step("readShaderFiles", [&]() {
+			code.vert = readFile("vert.spv");
+			code.frag = readFile("frag.spv");
+		});
+		return code;
+	});
+
+	step("createVInstance", [this]() { createVInstance(); });
+	step("setupDebugMessenger", [this]() { setupDebugMessenger(); });
+	step("createSurface", [this]() { createSurface(); }); //Inits vkSurface
+	step("createPhysicalDevice", [this]() { createPhysicalDevice(); }); //Inits vkPhysicalDevice, caches its queries
+	step("createDevice", [this]() { createDevice(); }); //Inits vkDevice, Queues - graphicsQueue, presentQueue
+	step("createPipelineCache", [this]() { createPipelineCache(); });
+	step("createSwapChain", [this]() { createSwapChain(); }); //Inits vkSwapChain, swapChainImages
+	if (!useDynamicRendering)
+	{
+		step("createRenderPass", [this]() { createRenderPass(); });
+	}
+
+	std::future<void> pipeline = std::async(std::launch::async, [this, &shaderCode]() {
+		ShaderCode code = shaderCode.get();
+		step("createGraphicsPipeline", [&]() { createGraphicsPipeline(code); });
+		if (options.deviceCount > 1)
+		{
+			step("createPeerDevices", [&]() { createPeerDevices(code); });
+		}
+	});
+
+	step("createImageViews", [this]() { createImageViews(); }); //Inits swapChainImageView
+	if (!useDynamicRendering)
+	{
+		step("createFramebuffers", [this]() { createFramebuffers(); });
+	}
+	step("createCommandPool", [this]() { createCommandPool(); });
+	step("createCommandBuffers", [this]() { createCommandBuffers(); });
+	step("createSyncObjects", [this]() { createSyncObjects(); });
+
+	if (options.sceneInstances > 0 || options.sceneLights > 0)
+	{
+		step("populateScene", [this]() { populateScene(); });
+	}
+
+	if (options.needsCapture())
+	{
+		step("createCaptureBuffer", [this]() { createCaptureBuffer(); });
+	}
+
+	if (options.needsExport() || options.isServer())
+	{
+		step("createExportRing", [this]() { createExportRing(); });
+	}
+
+	pipeline.get();
+
+	if (options.isBenchmark())
+	{
+		startup.report();
+	}
+}
+
+
+void Engine::cleanup()
+{
+	//Nothing may be in use by the GPU past this point
+	vkDeviceWaitIdle(vkDevice);
+
+	//Background compiles register their pipelines themselves, let them finish first
+	for (auto& pending : pendingVariants)
+	{
+		pending.second.wait();
+	}
+
+	//Peer devices share nothing with the presenting device and go first
+	for (auto& peer : peers)
+	{
+		for (auto& pending : peer.pendingPipelines)
+		{
+			pending.second.wait();
+		}
+		vkDeviceWaitIdle(peer.device);
+		peer.deletionQueue.flush();
+		vkDestroyDevice(peer.device, nullptr);
+	}
+
+	savePipelineCache();
+
+	releaseSceneBuffer(instanceBuffer);
+	releaseSceneBuffer(materialBuffer);
+	releaseSceneBuffer(lightBuffer);
+	VkPipeline genericPipeline = vkGraphicsPipeline;
+	retire("VkPipeline", [this, genericPipeline]() { vkDestroyPipeline(vkDevice, genericPipeline, nullptr); });
+	for (auto& frame : frames)
+	{
+		releaseSceneBuffer(frame.sceneStaging);
+	}
+
+	for (auto& frame : frames)
+	{
+		frame.deletionQueue.flush();
+	}
+	deviceDeletionQueue.flush();
+
+	vkDestroyDevice(vkDevice, nullptr);
+	if (debugMessenger != VK_NULL_HANDLE)
+	{
+		DestroyDebugUtilsMessengerEXT(vkInstance, debugMessenger, nullptr);
+	}
+	vkDestroySurfaceKHR(vkInstance, vkSurface, nullptr);
+	vkDestroyInstance(vkInstance, nullptr);
+	if (window != nullptr)
+	{
+		glfwDestroyWindow(window);
+	}
+	glfwTerminate();
+
+	liveObjects.report();
+}
+
+bool checkValidationLayerSupport(std::set<const char*> requiredLayers)
+{
+	uint32_t count = 0;
+	vkEnumerateInstanceLayerProperties(&count, nullptr);
+
+	std::vector<VkLayerProperties> availableLayers(count);
+	vkEnumerateInstanceLayerProperties(&count, availableLayers.data());
+
+	for (const auto& layers : availableLayers)
+	{
+		auto itr = requiredLayers.find(layers.layerName);
+		if (itr != requiredLayers.end())
+		{
+			requiredLayers.erase(itr);
+		}
+	}
+
+	return requiredLayers.empty();
+
+}
+
+std::vector<const char*> getInstanceLevelExtensions(bool headless)
+{
+	std::vector<const char*> requiredExtensions;
+	if (headless)
+	{
+		requiredExtensions = { VK_KHR_SURFACE_EXTENSION_NAME, VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME };
+	}
+	else
+	{
+		const char** glfwExtensions;
+		uint32_t count = 0;
+
+		glfwExtensions = glfwGetRequiredInstanceExtensions(&count);
+
+		requiredExtensions.assign(glfwExtensions, glfwExtensions + count);
+	}
+
+	//Enable vulkan debugging
+	requiredExtensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+
+	return requiredExtensions;
+
+}
+
+void Engine::createVInstance()
+{
+	VkApplicationInfo appInfo = {};
+	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+	appInfo.pApplicationName = "Basic_Triangle_Renderer";
+	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
+	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
+	appInfo.pEngineName = "Purva_Engine";
+	appInfo.apiVersion = VK_API_VERSION_1_2; //Devices below 1.2 still work, optional features are checked per device
+
+	VkInstanceCreateInfo createInfo = {}; //Either set 0 or initialize every member.
+	createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	createInfo.pApplicationInfo = &appInfo;
+	
+	//Check and enable validation layer support
+	std::set<const char*> requiredLayers(validationLayers.begin(), validationLayers.end());
+	if (checkValidationLayerSupport(requiredLayers))
+	{
+		createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
+		createInfo.ppEnabledLayerNames = validationLayers.data();
+	}
+	else
+	{
+		createInfo.enabledLayerCount = static_cast<uint32_t>(0);
+		createInfo.ppEnabledLayerNames = nullptr;
+	}
+
+	std::vector<const char*> requiredExtensions = getInstanceLevelExtensions(headless);
+
+	if (headless)
+	{
+		uint32_t count = 0;
+		vkEnumerateInstanceExtensionProperties(nullptr, &count, nullptr);
+		std::vector<VkExtensionProperties> available(count);
+		vkEnumerateInstanceExtensionProperties(nullptr, &count, available.data());
+		bool found = std::any_of(available.begin(), available.end(), [](const VkExtensionProperties& extension) {
+			return strcmp(extension.extensionName, VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME) == 0;
+		});
+		if (!found)
+		{
+			throw std::runtime_error("No display and VK_EXT_headless_surface is not available.");
+		}
+	}
+
+	//Enable instance level extensions
+	createInfo.enabledExtensionCount = static_cast<uint32_t>(requiredExtensions.size());
+	createInfo.ppEnabledExtensionNames = requiredExtensions.data();
+	
+
+	if (vkCreateInstance(&createInfo, nullptr, &vkInstance) != VK_SUCCESS) {
+		throw std::runtime_error("Instance creation failed.");
+	}
+}
+
+void Engine::createSurface()
+{
+	//Headless surfaces have no size of their own, the swapchain gets WIDTH x HEIGHT
+	if (headless)
+	{
+		auto func = (PFN_vkCreateHeadlessSurfaceEXT)vkGetInstanceProcAddr(vkInstance, "vkCreateHeadlessSurfaceEXT");
+		VkHeadlessSurfaceCreateInfoEXT createInfo{};
+		createInfo.sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT;
+		if (func == nullptr || func(vkInstance, &createInfo, nullptr, &vkSurface) != VK_SUCCESS)
+		{
+			throw std::runtime_error("Headless surface creation failed!");
+		}
+		return;
+	}
+
+	if (glfwCreateWindowSurface(vkInstance, window, nullptr, &vkSurface) != VK_SUCCESS)
+	{
+		throw std::runtime_error("Surface creation failed!");
+	}
+}
+
+QueueFamilyIndices getQueueFamilyIndices(const VkPhysicalDevice& vkPhysicalDevice, const VkSurfaceKHR& vkSurface)
+{
+	uint32_t reqQueueFamilyCount = 0;
+	std::vector<VkQueueFamilyProperties> reqQueueFamilyProps;
+
+	vkGetPhysicalDeviceQueueFamilyProperties(vkPhysicalDevice, &reqQueueFamilyCount, nullptr);
+
+	if (reqQueueFamilyCount > 0)
+	{
+		reqQueueFamilyProps.resize(reqQueueFamilyCount);
+		vkGetPhysicalDeviceQueueFamilyProperties(vkPhysicalDevice, &reqQueueFamilyCount, reqQueueFamilyProps.data());
+	}
+	QueueFamilyIndices indices;
+
+	int index = 0;
+	for (auto& queueFamilyProp : reqQueueFamilyProps)
+	{
+		if (queueFamilyProp.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+		{
+			indices.graphicsFamilyIndex = index;
+		}
+
+		VkBool32 isExistPresentFamily = false;
+
+		vkGetPhysicalDeviceSurfaceSupportKHR(vkPhysicalDevice, index, vkSurface, &isExistPresentFamily);
+
+		if (isExistPresentFamily)
+		{
+			indices.presentFamilyIndex = index;
+		}
+
+		if (indices.isComplete()) break;
+		index++;
+	}
+
+	return indices;
+}
+
+SwapChainDetails getSwapChainDetails(const VkPhysicalDevice &vkPhysicalDevice, const VkSurfaceKHR &vkSurface)
+{
+	SwapChainDetails details;
+	//1. Get available surface capabilities
+	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(vkPhysicalDevice, vkSurface, &details.surfaceCapabilities);
+
+	//2. Get available formats
+	uint32_t formatCount = 0;
+	vkGetPhysicalDeviceSurfaceFormatsKHR(vkPhysicalDevice, vkSurface, &formatCount, nullptr);
+	if (formatCount > 0)
+	{
+		details.formats.resize(formatCount);
+		vkGetPhysicalDeviceSurfaceFormatsKHR(vkPhysicalDevice, vkSurface, &formatCount, details.formats.data());
+	}
+
+	//3. Get available present modes
+	uint32_t presentModeCount = 0;
+	vkGetPhysicalDeviceSurfacePresentModesKHR(vkPhysicalDevice, vkSurface, &presentModeCount, nullptr);
+	if (presentModeCount > 0)
+	{
+		details.presentModes.resize(presentModeCount);
+		vkGetPhysicalDeviceSurfacePresentModesKHR(vkPhysicalDevice, vkSurface, &presentModeCount, details.presentModes.data());
+	}
+
+	return details;
+}
+
+bool checkDeviceLevelExtensions(const VkPhysicalDevice& vkPhysicalDevice)
+{
+	uint32_t count;
+	vkEnumerateDeviceExtensionProperties(vkPhysicalDevice, nullptr, &count, nullptr);
+	std::vector<VkExtensionProperties> availableExtensions(count);
+	vkEnumerateDeviceExtensionProperties(vkPhysicalDevice, nullptr, &count, availableExtensions.data());
+
+	std::set<std::string> requiredExtensions(device_extensions.begin(), device_extensions.end());
+
+	for (const auto &extension : availableExtensions)
+	{
+		requiredExtensions.erase(extension.extensionName);
+	}
+
+	return requiredExtensions.empty();
+}
+
+bool isDeviceExtensionAvailable(const VkPhysicalDevice& vkPhysicalDevice, const char* extensionName)
+{
+	uint32_t count;
+	vkEnumerateDeviceExtensionProperties(vkPhysicalDevice, nullptr, &count, nullptr);
+	std::vector<VkExtensionProperties> availableExtensions(count);
+	vkEnumerateDeviceExtensionProperties(vkPhysicalDevice, nullptr, &count, availableExtensions.data());
+
+	for (const auto& extension : availableExtensions)
+	{
+		if (strcmp(extension.extensionName, extensionName) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//Timeline semaphores are core in Vulkan 1.2 and the feature is mandatory there, but check anyway
+bool isTimelineSemaphoreSupported(const VkPhysicalDevice& vkPhysicalDevice)
+{
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(vkPhysicalDevice, &properties);
+	if (properties.apiVersion < VK_API_VERSION_1_2)
+	{
+		return false;
+	}
+
+	VkPhysicalDeviceVulkan12Features vulkan12Features{};
+	vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_12_FEATURES;
+
+	VkPhysicalDeviceFeatures2 features{};
+	features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	features.pNext = &vulkan12Features;
+	vkGetPhysicalDeviceFeatures2(vkPhysicalDevice, &features);
+
+	return vulkan12Features.timelineSemaphore == VK_TRUE;
+}
+
+//VK_KHR_dynamic_rendering needs a 1.2 device (its dependencies are core there) and the feature bit
+bool isDynamicRenderingSupported(const VkPhysicalDevice& vkPhysicalDevice)
+{
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(vkPhysicalDevice, &properties);
+	if (properties.apiVersion < VK_API_VERSION_1_2 || !isDeviceExtensionAvailable(vkPhysicalDevice, VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME))
+	{
+		return false;
+	}
+
+	VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamicRenderingFeatures{};
+	dynamicRenderingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+
+	VkPhysicalDeviceFeatures2 features{};
+	features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	features.pNext = &dynamicRenderingFeatures;
+	vkGetPhysicalDeviceFeatures2(vkPhysicalDevice, &features);
+
+	return dynamicRenderingFeatures.dynamicRendering == VK_TRUE;
+}
+
+bool isDeviceSuitable(const VkPhysicalDevice& vkPhysicalDevice, const QueueFamilyIndices& indices, const SwapChainDetails& details)
+{
+	//1. Check if supports queue families - indices and swapchain details are queried by the caller
+	
+	//2. Check if supports device level extensions
+	bool isExtenionSupported = checkDeviceLevelExtensions(vkPhysicalDevice);
+	
+	//3. Check if has swap chain support
+	bool isSwapChainSupport = details.formats.size() > 0 && details.presentModes.size() > 0;
+
+	return indices.isComplete() && isExtenionSupported && isSwapChainSupport;
+}
+
+//Discrete GPUs first, software rasterizers last
+int rankPhysicalDevice(const VkPhysicalDevice& vkPhysicalDevice)
+{
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(vkPhysicalDevice, &properties);
+
+	switch (properties.deviceType)
+	{
+	case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return 4;
+	case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return 3;
+	case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return 2;
+	case VK_PHYSICAL_DEVICE_TYPE_CPU: return 1;
+	default: return 0;
+	}
+}
+
+//Peer devices only render offscreen, any graphics queue will do
+std::optional<uint32_t> getGraphicsFamilyIndex(const VkPhysicalDevice& vkPhysicalDevice)
+{
+	uint32_t count = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(vkPhysicalDevice, &count, nullptr);
+	std::vector<VkQueueFamilyProperties> families(count);
+	vkGetPhysicalDeviceQueueFamilyProperties(vkPhysicalDevice, &count, families.data());
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
+		{
+			return i;
+		}
+	}
+
+	return std::nullopt;
+}
+
+void Engine::createPhysicalDevice()
+{
+	uint32_t count = 0;
+	vkEnumeratePhysicalDevices(vkInstance, &count, nullptr);
+	std::vector<VkPhysicalDevice> availableDevices(count);
+	vkEnumeratePhysicalDevices(vkInstance, &count, availableDevices.data());
+
+	//Query each candidate once and keep the results of the best ranked suitable one for the rest of startup
+	int bestRank = -1;
+	for (auto physicalDevice : availableDevices)
+	{
+		QueueFamilyIndices indices = getQueueFamilyIndices(physicalDevice, vkSurface);
+		SwapChainDetails details = getSwapChainDetails(physicalDevice, vkSurface);
+		bool suitable = isDeviceSuitable(physicalDevice, indices, details);
+		int rank = rankPhysicalDevice(physicalDevice);
+
+		if (options.isBenchmark())
+		{
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+			std::cout << "device: " << properties.deviceName << ", rank " << rank << (suitable ? "" : ", cannot present") << std::endl;
+		}
+
+		if (suitable && rank > bestRank)
+		{
+			bestRank = rank;
+			vkPhysicalDevice = physicalDevice;
+			queueFamilyIndices = indices;
+			swapChainDetails = details;
+		}
+	}
+
+	if (vkPhysicalDevice == VK_NULL_HANDLE)
+	{
+		throw std::runtime_error("Could not find GPU.");
+	}
+
+	useDynamicRendering = !options.forceRenderPass && isDynamicRenderingSupported(vkPhysicalDevice);
+	useTimelineSemaphore = isTimelineSemaphoreSupported(vkPhysicalDevice);
 }
 
 void Engine::createDevice()
 {
-	VkDeviceCreateInfo createInfo = {};
-	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+	VkDeviceCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+
+	//1. Add physical device features - Adding none for now
+	VkPhysicalDeviceFeatures vkDeviceFeatures = {};
+	createInfo.pEnabledFeatures = &vkDeviceFeatures;
+
+	//2. Add validation layers
+	createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
+	createInfo.ppEnabledLayerNames = validationLayers.data();
+
+	//3. Add device level extensions, required ones plus optional ones this device supports
+	std::vector<const char*> enabledExtensions(device_extensions.begin(), device_extensions.end());
+	void* featureChain = nullptr;
+
+	VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamicRenderingFeatures{};
+	dynamicRenderingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+	if (useDynamicRendering)
+	{
+		enabledExtensions.push_back(VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME);
+		dynamicRenderingFeatures.dynamicRendering = VK_TRUE;
+		dynamicRenderingFeatures.pNext = featureChain;
+		featureChain = &dynamicRenderingFeatures;
+	}
+
+	VkPhysicalDeviceVulkan12Features vulkan12Features{};
+	vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_12_FEATURES;
+	if (useTimelineSemaphore)
+	{
+		vulkan12Features.timelineSemaphore = VK_TRUE;
+		vulkan12Features.pNext = featureChain;
+		featureChain = &vulkan12Features;
+	}
+	createInfo.pNext = featureChain;
+	createInfo.enabledExtensionCount = static_cast<uint32_t>(enabledExtensions.size());
+	createInfo.ppEnabledExtensionNames = enabledExtensions.data();
+
+	//4. Add queues - graphics and present
+	const QueueFamilyIndices& indices = queueFamilyIndices;
+	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
+	std::set<uint32_t> uniqueQueueFamilyIndices = {indices.graphicsFamilyIndex.value(), indices.presentFamilyIndex.value() }; //If both same, only one queue will be formed
+	
+	float queuePriority = 1.0;
+	for (uint32_t uniqueQueueFamily : uniqueQueueFamilyIndices)
+	{
+		VkDeviceQueueCreateInfo queueCreateInfo = {};
+		queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+		queueCreateInfo.queueCount = 1;
+		queueCreateInfo.queueFamilyIndex = uniqueQueueFamily;
+		queueCreateInfo.pQueuePriorities = &queuePriority;
+
+		queueCreateInfos.push_back(queueCreateInfo);
+	}
+	
+	createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
+	createInfo.pQueueCreateInfos = queueCreateInfos.data();
+
+	if (vkCreateDevice(vkPhysicalDevice, &createInfo, nullptr, &vkDevice) != VK_SUCCESS)
+	{
+		throw std::runtime_error("Logical Device creation failed");
+	}
+
+	vkGetDeviceQueue(vkDevice, indices.graphicsFamilyIndex.value(), 0, &graphicsQueue);
+	vkGetDeviceQueue(vkDevice, indices.presentFamilyIndex.value(), 0, &presentQueue);
+
+	if (useDynamicRendering)
+	{
+		pfnCmdBeginRendering = (PFN_vkCmdBeginRenderingKHR)vkGetDeviceProcAddr(vkDevice, "vkCmdBeginRenderingKHR");
+		pfnCmdEndRendering = (PFN_vkCmdEndRenderingKHR)vkGetDeviceProcAddr(vkDevice, "vkCmdEndRenderingKHR");
+		if (pfnCmdBeginRendering == nullptr || pfnCmdEndRendering == nullptr)
+		{
+			throw std::runtime_error("Dynamic rendering entry points missing");
+		}
+	}
+}
+
+
+void Engine::createSwapChain()
+{
+	//1. Swapchain details of the selected physical device were cached by createPhysicalDevice()
+	//2. Choose surface format
+	VkSurfaceFormatKHR vkSurfaceFormat = swapChainDetails.formats[0];
+	//Choose sRGB format with 8 bits for each component
+	for (const auto& surfaceFormat : swapChainDetails.formats)
+	{
+		if (surfaceFormat.format == VK_FORMAT_B8G8R8A8_SRGB && surfaceFormat.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR)
+		{
+			vkSurfaceFormat = surfaceFormat;
+		}
+	}
+	//3. Choose surface present mode
+	VkPresentModeKHR vkPresentMode = VK_PRESENT_MODE_FIFO_KHR; //FIFO is always available
+	//Choose mail box present mode - replace older images from queuw with recent ones if queue is full.
+	//Benchmarks and servers prefer immediate mode so frame times are not capped by vertical blank.
+	for (const auto& presentMode : swapChainDetails.presentModes)
+	{
+		if (presentMode == VK_PRESENT_MODE_MAILBOX_KHR && vkPresentMode != VK_PRESENT_MODE_IMMEDIATE_KHR)
+		{
+			vkPresentMode = presentMode;
+		}
+		if (presentMode == VK_PRESENT_MODE_IMMEDIATE_KHR && (options.isBenchmark() || options.isServer()))
+		{
+			vkPresentMode = presentMode;
+		}
+	}
+	//4. Choose surface extent
+	VkExtent2D vkExtent;
+
+	if (swapChainDetails.surfaceCapabilities.currentExtent.width != std::numeric_limits<uint32_t>::max())
+	{
+		vkExtent = swapChainDetails.surfaceCapabilities.currentExtent;
+	}
+	else if (headless)
+	{
+		vkExtent = { WIDTH, HEIGHT };
+	}
+	else
+	{
+		int width, height;
+		glfwGetFramebufferSize(window, &width, &height);
+		vkExtent = { static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+	}
+	vkExtent.width = std::clamp(vkExtent.width, swapChainDetails.surfaceCapabilities.minImageExtent.width, swapChainDetails.surfaceCapabilities.maxImageExtent.width);
+	vkExtent.height = std::clamp(vkExtent.height, swapChainDetails.surfaceCapabilities.minImageExtent.height, swapChainDetails.surfaceCapabilities.maxImageExtent.height);
+	
+	//5. Create swapchain object
+	uint32_t imageCount = swapChainDetails.surfaceCapabilities.minImageCount + 1;
+
+	VkSwapchainCreateInfoKHR createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+	createInfo.surface = vkSurface;
+	createInfo.minImageCount = imageCount;
+	createInfo.imageFormat = vkSurfaceFormat.format;
+	createInfo.imageColorSpace = vkSurfaceFormat.colorSpace;
+	createInfo.imageExtent = vkExtent;
+	createInfo.presentMode = vkPresentMode;
+	createInfo.imageArrayLayers = 1; // A 3D stereo image would have additional layer to store depth
+	createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+	if (options.needsReadback())
+	{
+		//Swapchain images are copied to host buffers for frame capture, export and job results
+		if (!(swapChainDetails.surfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT))
+		{
+			throw std::runtime_error("Swap chain images cannot be read back for capture, export or serving.");
+		}
+		createInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	}
+	if (options.deviceCount > 1)
+	{
+		//Peer bands are copied into the swapchain image before it is presented
+		if (!(swapChainDetails.surfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT))
+		{
+			throw std::runtime_error("Swap chain images cannot receive peer device bands.");
+		}
+		createInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	}
+	createInfo.preTransform = swapChainDetails.surfaceCapabilities.currentTransform; //Flip/rotate/etc.
+	createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+	createInfo.clipped = VK_TRUE;
+	createInfo.oldSwapchain = VK_NULL_HANDLE; //Incase of window resize, new swapchain object needs to be created and oldSwapchain will point to the current swapchain object 
+	
+	const QueueFamilyIndices& indices = queueFamilyIndices;
+	uint32_t sharedFamilyIndices[] = { indices.graphicsFamilyIndex.value(), indices.presentFamilyIndex.value() };
+
+	if (indices.graphicsFamilyIndex != indices.presentFamilyIndex) 
+	{
+		createInfo.imageSharingMode = VK_SHARING_MODE_CONCURRENT; //No particular queue family will have ownership of the swapchain
+		createInfo.queueFamilyIndexCount = 2;
+		createInfo.pQueueFamilyIndices = sharedFamilyIndices;
+	}
+	else {
+		createInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	}
+
+	if (vkCreateSwapchainKHR(vkDevice, &createInfo, nullptr, &vkSwapChain) != VK_SUCCESS)
+	{
+		throw std::runtime_error("Swap chain creation failed");
+	}
+	VkSwapchainKHR swapChain = vkSwapChain;
+	keepUntilCleanup("VkSwapchainKHR", [this, swapChain]() { vkDestroySwapchainKHR(vkDevice, swapChain, nullptr); });
+											  
+	//6. Create an array to store swapchain images
+	swapChainImageFormat = vkSurfaceFormat.format;
+	swapChainImageExtent = vkExtent;
+
+	vkGetSwapchainImagesKHR(vkDevice, vkSwapChain, &imageCount, nullptr);
+	swapChainImages.resize(imageCount);
+	vkGetSwapchainImagesKHR(vkDevice, vkSwapChain, &imageCount, swapChainImages.data());
+}
+
+void Engine::createImageViews()
+{
+	swapChainImageViews.resize(swapChainImages.size());
+
+	for (size_t i = 0; i < swapChainImages.size(); i++)
+	{
+		swapChainImageViews[i] = buildImageView(vkDevice, swapChainImages[i], swapChainImageFormat);
+		VkImageView imageView = swapChainImageViews[i];
+		keepUntilCleanup("VkImageView", [this, imageView]() { vkDestroyImageView(vkDevice, imageView, nullptr); });
+	}
+}
+
+VkImageView Engine::buildImageView(VkDevice device, VkImage image, VkFormat format)
+{
+	VkImageViewCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	createInfo.image = image;
+	createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	createInfo.format = format;
+	createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+	createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+	createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+	createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+	createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	createInfo.subresourceRange.baseMipLevel = 0;
+	createInfo.subresourceRange.levelCount = 1;
+	createInfo.subresourceRange.baseArrayLayer = 0;
+	createInfo.subresourceRange.layerCount = 1;
+
+	VkImageView imageView;
+	if (vkCreateImageView(device, &createInfo, nullptr, &imageView) != VK_SUCCESS)
+	{
+		throw std::runtime_error("SwapChain Imageview cannot be created!!!!!");
+	}
+	return imageView;
+}
+
+static std::vector<char> readFile(const std::string& filename) 
+{
+	std::ifstream file(filename, std::ios::ate | std::ios::binary);
+
+	if (!file.is_open()) 
+	{
+		throw std::runtime_error("failed to open file!");
+	}
+
+	size_t fileSize = (size_t)file.tellg();
+	std::vector<char> buffer(fileSize);
+
+	file.seekg(0);
+	file.read(buffer.data(), fileSize);
+	file.close();
+
+	return buffer;
+}
+
+VkShaderModule createShaderModule(const std::vector<char>& code, const VkDevice &vkDevice)
+{
+	VkShaderModule shaderModule;
+
+	VkShaderModuleCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	createInfo.codeSize = code.size();
+	createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+
+	if (vkCreateShaderModule(vkDevice, &createInfo, nullptr, &shaderModule) != VK_SUCCESS)
+	{
+		throw std::runtime_error("Error creating shader module");
+	}
+
+	return shaderModule;
+}
+
+const char* pipelineCacheFile = "pipeline_cache.bin";
+
+//Seeds the cache with the previous run's data. The driver validates the header and ignores data
+//from another device or driver version, so a stale file only costs the compile it would anyway.
+void Engine::createPipelineCache()
+{
+	std::vector<char> initialData;
+	try
+	{
+		initialData = readFile(pipelineCacheFile);
+	}
+	catch (const std::runtime_error&)
+	{
+		//First run, nothing cached yet
+	}
+
+	VkPipelineCacheCreateInfo createInfo{};
+	createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	createInfo.initialDataSize = initialData.size();
+	createInfo.pInitialData = initialData.empty() ? nullptr : initialData.data();
+
+	if (vkCreatePipelineCache(vkDevice, &createInfo, nullptr, &vkPipelineCache) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create pipeline cache!");
+	}
+	VkPipelineCache pipelineCache = vkPipelineCache;
+	keepUntilCleanup("VkPipelineCache", [this, pipelineCache]() { vkDestroyPipelineCache(vkDevice, pipelineCache, nullptr); });
+}
+
+void Engine::savePipelineCache()
+{
+	size_t size = 0;
+	if (vkGetPipelineCacheData(vkDevice, vkPipelineCache, &size, nullptr) != VK_SUCCESS || size == 0)
+	{
+		return;
+	}
+
+	std::vector<char> data(size);
+	if (vkGetPipelineCacheData(vkDevice, vkPipelineCache, &size, data.data()) != VK_SUCCESS)
+	{
+		return;
+	}
+
+	std::ofstream file(pipelineCacheFile, std::ios::binary);
+	file.write(data.data(), size);
+}
+
+//Shader modules and the pipeline layout shared by every variant built on one device. The caller owns them.
+PipelineTarget createPipelineTarget(const VkDevice& vkDevice, const ShaderCode& shaderCode)
+{
+	PipelineTarget target;
+	target.device = vkDevice;
+	target.vertShaderModule = createShaderModule(shaderCode.vert, vkDevice);
+	target.fragShaderModule = createShaderModule(shaderCode.frag, vkDevice);
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 0;
+	pipelineLayoutInfo.pushConstantRangeCount = 0;
+
+	if (vkCreatePipelineLayout(vkDevice, &pipelineLayoutInfo, nullptr, &target.layout) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create pipeline layout!");
+	}
+
+	return target;
+}
+
+void Engine::createGraphicsPipeline(const ShaderCode& shaderCode)
+{
+	//Shader modules outlive the generic pipeline, specialized variants are compiled from them later
+	pipelineTarget = createPipelineTarget(vkDevice, shaderCode);
+	pipelineTarget.renderPass = vkRenderPass;
+	pipelineTarget.colorFormat = swapChainImageFormat;
+	pipelineTarget.cache = vkPipelineCache;
+
+	VkShaderModule vertShaderModule = pipelineTarget.vertShaderModule;
+	VkShaderModule fragShaderModule = pipelineTarget.fragShaderModule;
+	VkPipelineLayout pipelineLayout = pipelineTarget.layout;
+	keepUntilCleanup("VkShaderModule", [this, vertShaderModule]() { vkDestroyShaderModule(vkDevice, vertShaderModule, nullptr); });
+	keepUntilCleanup("VkShaderModule", [this, fragShaderModule]() { vkDestroyShaderModule(vkDevice, fragShaderModule, nullptr); });
+	keepUntilCleanup("VkPipelineLayout", [this, pipelineLayout]() { vkDestroyPipelineLayout(vkDevice, pipelineLayout, nullptr); });
+
+	//Generic variant, drawn whenever the requested one is still compiling. It can be replaced at runtime,
+	//so it is released through retire() rather than living until cleanup.
+	vkGraphicsPipeline = buildGraphicsPipeline(PipelineVariantKey{}, pipelineTarget);
+	readyVariants[PipelineVariantKey{}] = vkGraphicsPipeline;
+	std::lock_guard<std::mutex> lock(lifetimeMutex);
+	liveObjects.created("VkPipeline");
+}
+
+//Rebuilds the generic pipeline while the frames in flight may still draw with the old one, as a shader
+//reload does. The old pipeline is retired with the current frame, no vkDeviceWaitIdle involved.
+void Engine::swapGenericPipeline()
+{
+	auto start = std::chrono::steady_clock::now();
+
+	VkPipeline old = vkGraphicsPipeline;
+	vkGraphicsPipeline = buildGraphicsPipeline(PipelineVariantKey{}, pipelineTarget);
+	readyVariants[PipelineVariantKey{}] = vkGraphicsPipeline;
+	{
+		std::lock_guard<std::mutex> lock(lifetimeMutex);
+		liveObjects.created("VkPipeline");
+	}
+	retire("VkPipeline", [this, old]() { vkDestroyPipeline(vkDevice, old, nullptr); });
+
+	pipelineSwaps++;
+	pipelineSwapMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+//Builds one variant for the given device, the caller owns it. Safe to call from worker threads.
+VkPipeline Engine::buildGraphicsPipeline(const PipelineVariantKey& key, const PipelineTarget& target)
+{
+	//0. Specialization constants, the same block for both stages
+	VkSpecializationMapEntry specializationEntries[] = {
+		{ 0, static_cast<uint32_t>(offsetof(PipelineVariantKey, sampleCount)), sizeof(uint32_t) },
+		{ 1, static_cast<uint32_t>(offsetof(PipelineVariantKey, bounceDepth)), sizeof(uint32_t) },
+		{ 2, static_cast<uint32_t>(offsetof(PipelineVariantKey, featureBits)), sizeof(uint32_t) }
+	};
+
+	VkSpecializationInfo specializationInfo{};
+	specializationInfo.mapEntryCount = 3;
+	specializationInfo.pMapEntries = specializationEntries;
+	specializationInfo.dataSize = sizeof(PipelineVariantKey);
+	specializationInfo.pData = &key;
+
+	//1. Create shader stage - Vertex
+	VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
+	vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+	vertShaderStageInfo.module = target.vertShaderModule;
+	vertShaderStageInfo.pName = "main";
+	vertShaderStageInfo.pSpecializationInfo = &specializationInfo;
+
+	//2. Create shader stage - Fragment
+	VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
+	fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	fragShaderStageInfo.module = target.fragShaderModule;
+	fragShaderStageInfo.pName = "main";
+	fragShaderStageInfo.pSpecializationInfo = &specializationInfo;
+	
+	VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo, fragShaderStageInfo };
+
+	//3. Set dynamic state
+	std::vector<VkDynamicState> dynamicStates = {
+		VK_DYNAMIC_STATE_VIEWPORT,
+		VK_DYNAMIC_STATE_SCISSOR
+	};
+
+	VkPipelineDynamicStateCreateInfo dynamicState{};
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+	dynamicState.pDynamicStates = dynamicStates.data();
+
+
+	//4. Create vertex input state
+	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	vertexInputInfo.vertexBindingDescriptionCount = 0;
+	vertexInputInfo.vertexAttributeDescriptionCount = 0;
+	
+	//5. Create Input assembly
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+	//6. Set viewport
+	VkPipelineViewportStateCreateInfo viewportState{};
+	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewportState.viewportCount = 1;
+	viewportState.scissorCount = 1;
+
+	//7. Set rasterizer
+	VkPipelineRasterizationStateCreateInfo rasterizer{};
+	rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	rasterizer.depthClampEnable = VK_FALSE; // clamp to near/ far planes?
+	rasterizer.rasterizerDiscardEnable = VK_FALSE; //if true geometry never passes to this stage
+	rasterizer.polygonMode = VK_POLYGON_MODE_FILL; //
+	rasterizer.lineWidth = 1.0f;
+	rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+	rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
+	rasterizer.depthBiasEnable = VK_FALSE;
+	/*rasterizer.depthBiasConstantFactor = 0.0f; // Optional
+	rasterizer.depthBiasClamp = 0.0f; // Optional
+	rasterizer.depthBiasSlopeFactor = 0.0f; // Optional*/
+
+	//8. Set multisampling
+	VkPipelineMultisampleStateCreateInfo multisampling{};
+	multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	multisampling.sampleShadingEnable = VK_FALSE;
+	multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+	//9. Set color blending
+	VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+	colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+	colorBlendAttachment.blendEnable = VK_FALSE;
+
+	VkPipelineColorBlendStateCreateInfo colorBlending{};
+	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	colorBlending.logicOpEnable = VK_FALSE;
+	colorBlending.logicOp = VK_LOGIC_OP_COPY;
+	colorBlending.attachmentCount = 1;
+	colorBlending.pAttachments = &colorBlendAttachment;
+	colorBlending.blendConstants[0] = 0.0f;
+	colorBlending.blendConstants[1] = 0.0f;
+	colorBlending.blendConstants[2] = 0.0f;
+	colorBlending.blendConstants[3] = 0.0f;
+
+	//10. Create pipeline
+	VkGraphicsPipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	pipelineInfo.stageCount = 2;
+	pipelineInfo.pStages = shaderStages;
+	pipelineInfo.pVertexInputState = &vertexInputInfo;
+	pipelineInfo.pInputAssemblyState = &inputAssembly;
+	pipelineInfo.pViewportState = &viewportState;
+	pipelineInfo.pRasterizationState = &rasterizer;
+	pipelineInfo.pMultisampleState = &multisampling;
+	pipelineInfo.pColorBlendState = &colorBlending;
+	pipelineInfo.pDynamicState = &dynamicState;
+	pipelineInfo.layout = target.layout;
+	pipelineInfo.renderPass = target.renderPass;
+	pipelineInfo.subpass = 0;
+
+	//Without a render pass the pipeline only needs the attachment formats
+	VkPipelineRenderingCreateInfoKHR renderingInfo{};
+	renderingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR;
+	renderingInfo.colorAttachmentCount = 1;
+	renderingInfo.pColorAttachmentFormats = &target.colorFormat;
+	if (target.renderPass == VK_NULL_HANDLE)
+	{
+		pipelineInfo.renderPass = VK_NULL_HANDLE;
+		pipelineInfo.pNext = &renderingInfo;
+	}
+	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+
+	VkPipeline pipeline;
+	if (vkCreateGraphicsPipelines(target.device, target.cache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create graphics pipeline!");
+	}
+
+	return pipeline;
+}
+
+//Never blocks on a compile: a variant seen for the first time is queued on a worker and the
+//generic variant is returned until it is ready.
+VkPipeline Engine::getPipelineVariant(const PipelineVariantKey& key)
+{
+	variantStats.requests++;
+
+	auto pending = pendingVariants.find(key);
+	if (pending != pendingVariants.end() && pending->second.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+	{
+		collectVariantCompile(pending);
+	}
+	else if (pending == pendingVariants.end() && readyVariants.count(key) == 0 && failedVariants.count(key) == 0)
+	{
+		startVariantCompile(key);
+	}
+
+	auto ready = readyVariants.find(key);
+	if (ready != readyVariants.end())
+	{
+		variantStats.hits++;
+		return ready->second;
+	}
+
+	variantStats.fallbacks++;
+	return vkGraphicsPipeline;
+}
+
+void Engine::startVariantCompile(const PipelineVariantKey& key)
+{
+	pendingVariants[key] = std::async(std::launch::async, [this, key]() {
+		auto start = std::chrono::steady_clock::now();
+		VkPipeline pipeline = buildGraphicsPipeline(key, pipelineTarget);
+		keepUntilCleanup("VkPipeline", [this, pipeline]() { vkDestroyPipeline(vkDevice, pipeline, nullptr); });
+		return std::make_pair(pipeline, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	});
+}
+
+//Takes a finished compile off its future. A compile that threw is logged once and its key is marked failed,
+//so one bad variant costs its frames the specialization instead of ending the frame loop.
+void Engine::collectVariantCompile(std::map<PipelineVariantKey, std::future<std::pair<VkPipeline, double>>>::iterator pending)
+{
+	PipelineVariantKey key = pending->first;
+	try
+	{
+		auto compiled = pending->second.get();
+		readyVariants[key] = compiled.first;
+		variantStats.compiled++;
+		variantStats.compileMs += compiled.second;
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "pipeline variant " << key.sampleCount << "," << key.bounceDepth << "," << key.featureBits
+			<< " failed to compile, drawing the generic variant instead: " << e.what() << std::endl;
+		failedVariants.insert(key);
+		variantStats.failed++;
+	}
+	pendingVariants.erase(pending);
+}
+
+//Starts compiling the variant if nobody has asked for it yet. True once it can be drawn with.
+//Only probes: nothing is drawn, so the hit and fallback counts are left alone.
+bool Engine::requestPipelineVariant(const PipelineVariantKey& key)
+{
+	auto pending = pendingVariants.find(key);
+	if (pending != pendingVariants.end() && pending->second.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+	{
+		collectVariantCompile(pending);
+	}
+	else if (pending == pendingVariants.end() && readyVariants.count(key) == 0 && failedVariants.count(key) == 0)
+	{
+		startVariantCompile(key);
+	}
+	return readyVariants.count(key) != 0;
+}
+
+void Engine::createRenderPass()
+{
+	vkRenderPass = buildRenderPass(vkDevice, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+	VkRenderPass renderPass = vkRenderPass;
+	keepUntilCleanup("VkRenderPass", [this, renderPass]() { vkDestroyRenderPass(vkDevice, renderPass, nullptr); });
+}
+
+VkRenderPass Engine::buildRenderPass(VkDevice device, VkImageLayout finalLayout)
+{
+	VkAttachmentDescription colorAttachment{};
+	colorAttachment.format = swapChainImageFormat;
+	colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	colorAttachment.finalLayout = finalLayout;
+	
+	VkAttachmentReference colorAttachmentRef{};
+	colorAttachmentRef.attachment = 0;
+	colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	
+	VkSubpassDescription subpass{};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.colorAttachmentCount = 1;
+	subpass.pColorAttachments = &colorAttachmentRef;
+
+	VkRenderPassCreateInfo renderPassInfo{};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	renderPassInfo.attachmentCount = 1;
+	renderPassInfo.pAttachments = &colorAttachment;
+	renderPassInfo.subpassCount = 1;
+	renderPassInfo.pSubpasses = &subpass;
+
+	VkRenderPass renderPass;
+	if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) != VK_SUCCESS) 
+	{
+		throw std::runtime_error("failed to create render pass!");
+	}
+
+	return renderPass;
+}
+
+void Engine::createFramebuffers() {
+	swapChainFramebuffers.resize(swapChainImageViews.size());
+
+	for (size_t i = 0; i < swapChainImageViews.size(); i++) 
+	{
+		swapChainFramebuffers[i] = buildFramebuffer(vkDevice, vkRenderPass, swapChainImageViews[i]);
+		VkFramebuffer framebuffer = swapChainFramebuffers[i];
+		keepUntilCleanup("VkFramebuffer", [this, framebuffer]() { vkDestroyFramebuffer(vkDevice, framebuffer, nullptr); });
+	}
+}
+
+VkFramebuffer Engine::buildFramebuffer(VkDevice device, VkRenderPass renderPass, VkImageView imageView)
+{
+	VkImageView attachments[] = 
+	{
+		imageView
+	};
+
+	VkFramebufferCreateInfo framebufferInfo{};
+	framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+	framebufferInfo.renderPass = renderPass;
+	framebufferInfo.attachmentCount = 1;
+	framebufferInfo.pAttachments = attachments;
+	framebufferInfo.width = swapChainImageExtent.width;
+	framebufferInfo.height = swapChainImageExtent.height;
+	framebufferInfo.layers = 1;
+
+	VkFramebuffer framebuffer;
+	if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &framebuffer) != VK_SUCCESS) 
+	{
+		throw std::runtime_error("failed to create framebuffer!");
+	}
+
+	return framebuffer;
+}
+
+//Cost of rebuilding the render targets of every swapchain image, as a resize does. Dynamic rendering only
+//needs new image views; the fallback also needs a render pass and a framebuffer per image. Both are timed
+//on the same device whichever path is in use.
+double Engine::measureRenderTargetRecreation(uint32_t iterations, bool withRenderPass)
+{
+	if (iterations == 0)
+	{
+		return 0.0;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < iterations; i++)
+	{
+		std::vector<VkImageView> imageViews;
+		for (auto image : swapChainImages)
+		{
+			imageViews.push_back(buildImageView(vkDevice, image, swapChainImageFormat));
+		}
+
+		if (withRenderPass)
+		{
+			VkRenderPass renderPass = buildRenderPass(vkDevice, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+			std::vector<VkFramebuffer> framebuffers;
+			for (auto imageView : imageViews)
+			{
+				framebuffers.push_back(buildFramebuffer(vkDevice, renderPass, imageView));
+			}
+
+			for (auto framebuffer : framebuffers)
+			{
+				vkDestroyFramebuffer(vkDevice, framebuffer, nullptr);
+			}
+			vkDestroyRenderPass(vkDevice, renderPass, nullptr);
+		}
+
+		for (auto imageView : imageViews)
+		{
+			vkDestroyImageView(vkDevice, imageView, nullptr);
+		}
+	}
+
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+void Engine::createCommandPool() 
+{
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamilyIndex.value();
+
+	if (vkCreateCommandPool(vkDevice, &poolInfo, nullptr, &vkCommandPool) != VK_SUCCESS) 
+	{
+		throw std::runtime_error("failed to create command pool!");
+	}
+	VkCommandPool commandPool = vkCommandPool;
+	keepUntilCleanup("VkCommandPool", [this, commandPool]() { vkDestroyCommandPool(vkDevice, commandPool, nullptr); });
+}
+
+//One command buffer per frame in flight, freed together with the pool
+void Engine::createCommandBuffers() 
+{
+	VkCommandBufferAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.commandPool = vkCommandPool;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandBufferCount = 1;
+
+	for (auto& frame : frames)
+	{
+		if (vkAllocateCommandBuffers(vkDevice, &allocInfo, &frame.commandBuffer) != VK_SUCCESS) 
+		{
+			throw std::runtime_error("failed to allocate command buffers!");
+		}
+	}
+}
+
+//Single mip, single layer color image barrier
+void transitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout,
+	VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask, VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask)
+{
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = srcAccessMask;
+	barrier.dstAccessMask = dstAccessMask;
+	barrier.oldLayout = oldLayout;
+	barrier.newLayout = newLayout;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = 1;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+	vkCmdPipelineBarrier(commandBuffer, srcStageMask, dstStageMask, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+void Engine::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) 
+{
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = 0; // Optional
+	beginInfo.pInheritanceInfo = nullptr; // Optional
+
+	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+		throw std::runtime_error("failed to begin recording command buffer!");
+	}
+
+	//The presenting device's band is timed like the peers' bands, to balance them against each other
+	bool timeBand = !peers.empty() && timestampPool != VK_NULL_HANDLE;
+	if (timeBand)
+	{
+		vkCmdResetQueryPool(commandBuffer, timestampPool, currentFrame * 2, 2);
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampPool, currentFrame * 2);
+	}
+
+	//Transfers are not allowed inside a render pass
+	if (scene.instanceCount() > 0 || !scene.lights.records.empty() || instanceBuffer.buffer != VK_NULL_HANDLE)
+	{
+		recordSceneUpload(commandBuffer);
+	}
+
+	VkClearValue clearColor = { {{0.0f, 0.0f, 0.0f, 1.0f}} };
+
+	if (useDynamicRendering)
+	{
+		//The layout transitions a render pass would do implicitly are explicit here
+		transitionImageLayout(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+			0, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+
+		VkRenderingAttachmentInfoKHR colorAttachment{};
+		colorAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+		colorAttachment.imageView = swapChainImageViews[imageIndex];
+		colorAttachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+		colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		colorAttachment.clearValue = clearColor;
+
+		VkRenderingInfoKHR renderingInfo{};
+		renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR;
+		renderingInfo.renderArea.offset = { 0, 0 };
+		renderingInfo.renderArea.extent = swapChainImageExtent;
+		renderingInfo.layerCount = 1;
+		renderingInfo.colorAttachmentCount = 1;
+		renderingInfo.pColorAttachments = &colorAttachment;
+
+		pfnCmdBeginRendering(commandBuffer, &renderingInfo);
+	}
+	else
+	{
+		VkRenderPassBeginInfo renderPassInfo{};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = vkRenderPass;
+		renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+		renderPassInfo.renderArea.offset = { 0, 0 };
+		renderPassInfo.renderArea.extent = swapChainImageExtent;
+		renderPassInfo.clearValueCount = 1;
+		renderPassInfo.pClearValues = &clearColor;
+
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+	}
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipelineVariant(options.variant));
+	VkViewport viewport{};
+	viewport.x = 0.0f;
+	viewport.y = 0.0f;
+	viewport.width = static_cast<float>(swapChainImageExtent.width);
+	viewport.height = static_cast<float>(swapChainImageExtent.height);
+	viewport.minDepth = 0.0f;
+	viewport.maxDepth = 1.0f;
+	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+	VkRect2D scissor{};
+	scissor.offset = { 0, 0 };
+	scissor.extent = swapChainImageExtent;
+	//With peers only the rows above the staged peer bands are drawn, the bands are composited below. They were laid
+	//out a frame ago, before any rebalance since, and on the first frame there are none yet.
+	if (!peers.empty())
+	{
+		uint32_t lastRow = swapChainImageExtent.height;
+		for (const auto& peer : peers)
+		{
+			if (peer.stagedRows > 0)
+			{
+				lastRow = std::min(lastRow, peer.stagedFirstRow);
+			}
+		}
+		scissor.extent = { swapChainImageExtent.width, lastRow };
+	}
+	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+	vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+
+	if (useDynamicRendering)
+	{
+		pfnCmdEndRendering(commandBuffer);
+		transitionImageLayout(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, 0, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+	}
+	else
+	{
+		vkCmdEndRenderPass(commandBuffer);
+	}
+
+	if (timeBand)
+	{
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool, currentFrame * 2 + 1);
+		frames[currentFrame].timedRows = scissor.extent.height;
+	}
+
+	if (!peers.empty())
+	{
+		recordComposite(commandBuffer, imageIndex);
+	}
+
+	if (captureThisFrame)
+	{
+		recordCaptureCopy(commandBuffer, imageIndex, captureBuffer);
+	}
+
+	if (exportSlotThisFrame)
+	{
+		recordCaptureCopy(commandBuffer, imageIndex, exportSlots[*exportSlotThisFrame].buffer);
+	}
+
+	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) 
+	{
+		throw std::runtime_error("failed to record command buffer!");
+	}
+}
+
+uint32_t findMemoryType(const VkPhysicalDevice& vkPhysicalDevice, uint32_t typeFilter, VkMemoryPropertyFlags properties)
+{
+	VkPhysicalDeviceMemoryProperties memProperties;
+	vkGetPhysicalDeviceMemoryProperties(vkPhysicalDevice, &memProperties);
+
+	for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++)
+	{
+		if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties)
+		{
+			return i;
+		}
+	}
+
+	throw std::runtime_error("failed to find suitable memory type!");
+}
+
+void createBuffer(const VkDevice& vkDevice, const VkPhysicalDevice& vkPhysicalDevice, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory)
+{
+	VkBufferCreateInfo bufferInfo{};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = size;
+	bufferInfo.usage = usage;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	if (vkCreateBuffer(vkDevice, &bufferInfo, nullptr, &buffer) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create buffer!");
+	}
+
+	VkMemoryRequirements memRequirements;
+	vkGetBufferMemoryRequirements(vkDevice, buffer, &memRequirements);
+
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = memRequirements.size;
+	allocInfo.memoryTypeIndex = findMemoryType(vkPhysicalDevice, memRequirements.memoryTypeBits, properties);
+
+	if (vkAllocateMemory(vkDevice, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to allocate buffer memory!");
+	}
+
+	vkBindBufferMemory(vkDevice, buffer, bufferMemory, 0);
+}
+
+void Engine::createCaptureBuffer()
+{
+	VkDeviceSize size = static_cast<VkDeviceSize>(swapChainImageExtent.width) * swapChainImageExtent.height * 4;
+	createBuffer(vkDevice, vkPhysicalDevice, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, captureBuffer, captureBufferMemory);
+
+	VkBuffer buffer = captureBuffer;
+	VkDeviceMemory memory = captureBufferMemory;
+	keepUntilCleanup("VkDeviceMemory", [this, memory]() { vkFreeMemory(vkDevice, memory, nullptr); });
+	keepUntilCleanup("VkBuffer", [this, buffer]() { vkDestroyBuffer(vkDevice, buffer, nullptr); });
+}
+
+void Engine::recordCaptureCopy(VkCommandBuffer commandBuffer, uint32_t imageIndex, VkBuffer dstBuffer)
+{
+	//1. Rendering (and compositing) left the image in PRESENT_SRC, move it to TRANSFER_SRC
+	transitionImageLayout(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+	//2. Copy tightly packed pixels into the host visible buffer
+	VkBufferImageCopy region{};
+	region.bufferOffset = 0;
+	region.bufferRowLength = 0;
+	region.bufferImageHeight = 0;
+	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.imageSubresource.mipLevel = 0;
+	region.imageSubresource.baseArrayLayer = 0;
+	region.imageSubresource.layerCount = 1;
+	region.imageOffset = { 0, 0, 0 };
+	region.imageExtent = { swapChainImageExtent.width, swapChainImageExtent.height, 1 };
+	vkCmdCopyImageToBuffer(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, dstBuffer, 1, &region);
+
+	//3. Hand the image back to presentation and make the copy visible to the host
+	transitionImageLayout(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+		VK_ACCESS_TRANSFER_READ_BIT, 0, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+
+	VkBufferMemoryBarrier hostBarrier{};
+	hostBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	hostBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	hostBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	hostBarrier.buffer = dstBuffer;
+	hostBarrier.offset = 0;
+	hostBarrier.size = VK_WHOLE_SIZE;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &hostBarrier, 0, nullptr);
+}
+
+//Swapchain pixels are 4 bytes each, BGRA or RGBA depending on the surface format
+Image imageFromPixels(const uint8_t* pixels, uint32_t width, uint32_t height, VkFormat format)
+{
+	Image image;
+	image.width = width;
+	image.height = height;
+	image.rgb.resize(static_cast<size_t>(width) * height * 3);
+
+	bool isBGR = format == VK_FORMAT_B8G8R8A8_SRGB || format == VK_FORMAT_B8G8R8A8_UNORM;
+	for (size_t i = 0; i < static_cast<size_t>(width) * height; i++)
+	{
+		image.rgb[i * 3 + 0] = pixels[i * 4 + (isBGR ? 2 : 0)];
+		image.rgb[i * 3 + 1] = pixels[i * 4 + 1];
+		image.rgb[i * 3 + 2] = pixels[i * 4 + (isBGR ? 0 : 2)];
+	}
+
+	return image;
+}
+
+//Binary PPM (P6) keeps captures dependency free and byte exact
+void writePPM(const std::string& filename, const Image& image)
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (!file.is_open())
+	{
+		throw std::runtime_error("failed to open " + filename + " for writing!");
+	}
+
+	file << "P6\n" << image.width << " " << image.height << "\n255\n";
+	file.write(reinterpret_cast<const char*>(image.rgb.data()), image.rgb.size());
+}
+
+Image readPPM(const std::string& filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file.is_open())
+	{
+		throw std::runtime_error("failed to open " + filename + "!");
+	}
+
+	Image image;
+	std::string magic;
+	uint32_t maxValue = 0;
+	file >> magic >> image.width >> image.height >> maxValue;
+	file.get(); //single whitespace before pixel data
+
+	if (magic != "P6" || maxValue != 255)
+	{
+		throw std::runtime_error(filename + " is not an 8 bit binary PPM!");
+	}
+
+	image.rgb.resize(static_cast<size_t>(image.width) * image.height * 3);
+	file.read(reinterpret_cast<char*>(image.rgb.data()), image.rgb.size());
+	if (!file)
+	{
+		throw std::runtime_error(filename + " is truncated!");
+	}
+
+	return image;
+}
+
+//Root mean square error over all channels, on the 0-255 scale
+double imageRMSE(const Image& a, const Image& b)
+{
+	if (a.width != b.width || a.height != b.height)
+	{
+		return std::numeric_limits<double>::infinity();
+	}
+
+	double sum = 0.0;
+	for (size_t i = 0; i < a.rgb.size(); i++)
+	{
+		double diff = static_cast<double>(a.rgb[i]) - static_cast<double>(b.rgb[i]);
+		sum += diff * diff;
+	}
+
+	return a.rgb.empty() ? 0.0 : std::sqrt(sum / a.rgb.size());
+}
+
+//Quotes and backslashes escaped, enough for scene and device names
+std::string escapeJson(const std::string& text)
+{
+	std::string escaped;
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			escaped += '\\';
+		}
+		escaped += c;
+	}
+	return escaped;
+}
+
+//Start of a history line, everything that has to match for two runs to be comparable
+std::string historyRunKey(const std::string& scene, const std::string& device, VkExtent2D extent, uint32_t deviceCount)
+{
+	std::ostringstream key;
+	key << "{\"scene\":\"" << escapeJson(scene) << "\",\"device\":\"" << escapeJson(device) << "\",\"width\":" << extent.width
+		<< ",\"height\":" << extent.height << ",\"devices\":" << deviceCount << ",";
+	return key.str();
+}
+
+//Returns the median frame time of the latest history entry with the same run key, if any. Other scenes,
+//GPUs, resolutions and device counts are skipped.
+//History is JSON lines: one object per run, appended, never rewritten.
+std::optional<double> readBaselineFrameTime(const std::string& historyPath, const std::string& runKey)
+{
+	std::ifstream file(historyPath);
+	std::optional<double> baseline;
+	std::string line;
+	const std::string timeKey = "\"medianFrameMs\":";
+
+	while (std::getline(file, line))
+	{
+		size_t timePos = line.find(timeKey);
+		if (line.compare(0, runKey.size(), runKey) == 0 && timePos != std::string::npos)
+		{
+			baseline = std::stod(line.substr(timePos + timeKey.size()));
+		}
+	}
+
+	return baseline;
+}
+
+//UV sphere, (rings + 1) x (2 rings + 1) vertices with a seam so every UV is within [0, 1]
+Mesh generateSphere(uint32_t rings)
+{
+	const float pi = 3.14159265358979f;
+	uint32_t segments = rings * 2;
+	Mesh mesh;
+
+	for (uint32_t ring = 0; ring <= rings; ring++)
+	{
+		float theta = pi * ring / rings;
+		for (uint32_t segment = 0; segment <= segments; segment++)
+		{
+			float phi = 2.0f * pi * segment / segments;
+			MeshVertex vertex;
+			vertex.normal[0] = std::sin(theta) * std::cos(phi);
+			vertex.normal[1] = std::cos(theta);
+			vertex.normal[2] = std::sin(theta) * std::sin(phi);
+			memcpy(vertex.position, vertex.normal, sizeof(vertex.position));
+			vertex.uv[0] = static_cast<float>(segment) / segments;
+			vertex.uv[1] = static_cast<float>(ring) / rings;
+			mesh.vertices.push_back(vertex);
+		}
+	}
+
+	for (uint32_t ring = 0; ring < rings; ring++)
+	{
+		for (uint32_t segment = 0; segment < segments; segment++)
+		{
+			uint32_t a = ring * (segments + 1) + segment;
+			uint32_t b = a + segments + 1;
+			mesh.indices.insert(mesh.indices.end(), { a, b, a + 1, a + 1, b, b + 1 });
+		}
+	}
+
+	return mesh;
+}
+
+//Shuffles vertex and triangle order, the way meshes often come out of exporters and scanners
+void shuffleMesh(Mesh& mesh, uint32_t seed)
+{
+	std::mt19937 random(seed);
+
+	std::vector<uint32_t> remap(mesh.vertices.size());
+	for (uint32_t i = 0; i < remap.size(); i++) remap[i] = i;
+	std::shuffle(remap.begin(), remap.end(), random);
+
+	std::vector<MeshVertex> vertices(mesh.vertices.size());
+	for (size_t i = 0; i < remap.size(); i++) vertices[remap[i]] = mesh.vertices[i];
+	mesh.vertices = std::move(vertices);
+
+	std::vector<uint32_t> triangles(mesh.indices.size() / 3);
+	for (uint32_t i = 0; i < triangles.size(); i++) triangles[i] = i;
+	std::shuffle(triangles.begin(), triangles.end(), random);
+
+	std::vector<uint32_t> indices;
+	indices.reserve(mesh.indices.size());
+	for (uint32_t triangle : triangles)
+	{
+		for (uint32_t corner = 0; corner < 3; corner++)
+		{
+			indices.push_back(remap[mesh.indices[triangle * 3 + corner]]);
+		}
+	}
+	mesh.indices = std::move(indices);
+}
+
+//Tipsify (Sander, Nehab, Barczak 2007): emits triangles fanning around the vertex most likely to still
+//be in a FIFO post-transform cache of cacheSize entries. Linear in the number of triangles.
+std::vector<uint32_t> optimizeVertexCache(const std::vector<uint32_t>& indices, uint32_t vertexCount, uint32_t cacheSize)
+{
+	uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+
+	//1. Triangles adjacent to each vertex
+	std::vector<uint32_t> liveTriangles(vertexCount, 0);
+	for (uint32_t index : indices) liveTriangles[index]++;
+
+	std::vector<uint32_t> adjacencyOffset(vertexCount + 1, 0);
+	for (uint32_t v = 0; v < vertexCount; v++) adjacencyOffset[v + 1] = adjacencyOffset[v] + liveTriangles[v];
+	std::vector<uint32_t> adjacency(indices.size());
+	std::vector<uint32_t> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+	for (uint32_t i = 0; i < indices.size(); i++) adjacency[fill[indices[i]]++] = i / 3;
+
+	//2. Fan around the best candidate, fall back to the dead end stack, then to a linear scan
+	std::vector<uint32_t> cacheTime(vertexCount, 0);
+	std::vector<bool> emitted(triangleCount, false);
+	std::vector<uint32_t> deadEnd;
+	std::vector<uint32_t> output;
+	output.reserve(indices.size());
+
+	uint32_t time = cacheSize + 1;
+	uint32_t cursor = 0;
+	int64_t fanning = vertexCount > 0 ? 0 : -1;
+
+	while (fanning >= 0)
+	{
+		std::vector<uint32_t> candidates;
+		for (uint32_t a = adjacencyOffset[fanning]; a < adjacencyOffset[fanning + 1]; a++)
+		{
+			uint32_t triangle = adjacency[a];
+			if (emitted[triangle]) continue;
+			emitted[triangle] = true;
+
+			for (uint32_t corner = 0; corner < 3; corner++)
+			{
+				uint32_t v = indices[triangle * 3 + corner];
+				output.push_back(v);
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				liveTriangles[v]--;
+				if (time - cacheTime[v] > cacheSize)
+				{
+					cacheTime[v] = time++;
+				}
+			}
+		}
+
+		fanning = -1;
+		int64_t bestPriority = -1;
+		for (uint32_t v : candidates)
+		{
+			if (liveTriangles[v] == 0) continue;
+			int64_t priority = 0;
+			if (time - cacheTime[v] + 2 * liveTriangles[v] <= cacheSize)
+			{
+				priority = time - cacheTime[v];
+			}
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				fanning = v;
+			}
+		}
+
+		while (fanning < 0 && !deadEnd.empty())
+		{
+			uint32_t v = deadEnd.back();
+			deadEnd.pop_back();
+			if (liveTriangles[v] > 0) fanning = v;
+		}
+
+		while (fanning < 0 && cursor < vertexCount)
+		{
+			if (liveTriangles[cursor] > 0) fanning = cursor;
+			cursor++;
+		}
+	}
+
+	return output;
+}
+
+//Renumbers vertices in order of first use, so the vertex fetches of the reordered triangles walk memory forwards
+void reorderVerticesByFirstUse(Mesh& mesh)
+{
+	const uint32_t unused = std::numeric_limits<uint32_t>::max();
+	std::vector<uint32_t> remap(mesh.vertices.size(), unused);
+	std::vector<MeshVertex> vertices;
+	vertices.reserve(mesh.vertices.size());
+
+	for (uint32_t& index : mesh.indices)
+	{
+		if (remap[index] == unused)
+		{
+			remap[index] = static_cast<uint32_t>(vertices.size());
+			vertices.push_back(mesh.vertices[index]);
+		}
+		index = remap[index];
+	}
+	mesh.vertices = std::move(vertices);
+}
+
+//Average cache miss ratio: post-transform cache misses per triangle for a FIFO cache. 0.5 is the ideal for large regular meshes, 3 the worst.
+double averageCacheMissRatio(const std::vector<uint32_t>& indices, uint32_t cacheSize)
+{
+	std::deque<uint32_t> cache;
+	uint64_t misses = 0;
+	for (uint32_t index : indices)
+	{
+		if (std::find(cache.begin(), cache.end(), index) == cache.end())
+		{
+			misses++;
+			cache.push_back(index);
+			if (cache.size() > cacheSize) cache.pop_front();
+		}
+	}
+	return indices.empty() ? 0.0 : static_cast<double>(misses) / (indices.size() / 3);
+}
+
+//Octahedral mapping of a unit vector to two snorm16 values, a few hundredths of a degree of error
+void encodeOctahedral(const float normal[3], int16_t encoded[2])
+{
+	float length = std::fabs(normal[0]) + std::fabs(normal[1]) + std::fabs(normal[2]);
+	float x = normal[0] / length;
+	float y = normal[1] / length;
+	if (normal[2] < 0.0f)
+	{
+		float foldedX = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float foldedY = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = foldedX;
+		y = foldedY;
+	}
+	encoded[0] = static_cast<int16_t>(std::round(std::clamp(x, -1.0f, 1.0f) * 32767.0f));
+	encoded[1] = static_cast<int16_t>(std::round(std::clamp(y, -1.0f, 1.0f) * 32767.0f));
+}
+
+void decodeOctahedral(const int16_t encoded[2], float normal[3])
+{
+	float x = encoded[0] / 32767.0f;
+	float y = encoded[1] / 32767.0f;
+	float z = 1.0f - std::fabs(x) - std::fabs(y);
+	if (z < 0.0f)
+	{
+		float unfoldedX = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float unfoldedY = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = unfoldedX;
+		y = unfoldedY;
+	}
+	float length = std::sqrt(x * x + y * y + z * z);
+	normal[0] = x / length;
+	normal[1] = y / length;
+	normal[2] = z / length;
+}
+
+MeshStreams buildMeshStreams(const Mesh& mesh, bool quantize)
+{
+	MeshStreams streams;
+	streams.indices = mesh.indices;
+
+	bool uvsInRange = true;
+	for (const auto& vertex : mesh.vertices)
+	{
+		uvsInRange = uvsInRange && vertex.uv[0] >= 0.0f && vertex.uv[0] <= 1.0f && vertex.uv[1] >= 0.0f && vertex.uv[1] <= 1.0f;
+	}
+
+	for (const auto& vertex : mesh.vertices)
+	{
+		streams.positions.insert(streams.positions.end(), vertex.position, vertex.position + 3);
+
+		if (quantize)
+		{
+			int16_t encoded[2];
+			encodeOctahedral(vertex.normal, encoded);
+			streams.octNormals.insert(streams.octNormals.end(), encoded, encoded + 2);
+		}
+		else
+		{
+			streams.normals.insert(streams.normals.end(), vertex.normal, vertex.normal + 3);
+		}
+
+		//Tiled UVs do not fit unorm16, they stay float
+		if (quantize && uvsInRange)
+		{
+			streams.quantizedUVs.push_back(static_cast<uint16_t>(std::round(vertex.uv[0] * 65535.0f)));
+			streams.quantizedUVs.push_back(static_cast<uint16_t>(std::round(vertex.uv[1] * 65535.0f)));
+		}
+		else
+		{
+			streams.uvs.insert(streams.uvs.end(), vertex.uv, vertex.uv + 2);
+		}
+	}
+
+	return streams;
+}
+
+//Position only pass over every triangle (bounds and centroids, as a BVH build or a CPU ray cast reads
+//them). Returns triangles per second; the checksum keeps the loop from being optimized away.
+template<typename PositionOf>
+double measureTriangleThroughput(const std::vector<uint32_t>& indices, PositionOf positionOf, double& checksum)
+{
+	const uint32_t passes = 8;
+	auto start = std::chrono::steady_clock::now();
+	for (uint32_t pass = 0; pass < passes; pass++)
+	{
+		for (size_t i = 0; i < indices.size(); i += 3)
+		{
+			const float* a = positionOf(indices[i]);
+			const float* b = positionOf(indices[i + 1]);
+			const float* c = positionOf(indices[i + 2]);
+			float extent = std::max({ a[0], b[0], c[0] }) - std::min({ a[0], b[0], c[0] });
+			checksum += extent + (a[1] + b[1] + c[1]) + (a[2] + b[2] + c[2]);
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return seconds > 0.0 ? passes * (indices.size() / 3) / seconds : 0.0;
+}
 
-	//1. Add physical device features - Adding none for now
-	VkPhysicalDeviceFeatures vkDeviceFeatures = {};
-	createInfo.pEnabledFeatures = &vkDeviceFeatures;
+//Footprint, vertex cache efficiency and position pass throughput of an unordered interleaved mesh
+//against the optimized structure of arrays layout, float and quantized
+void benchmarkMeshLayout(const std::string& scene, uint32_t rings)
+{
+	const uint32_t cacheSize = 16;
 
-	//2. Add validation layers
-	createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
-	createInfo.ppEnabledLayerNames = validationLayers.data();
+	Mesh before = generateSphere(rings);
+	shuffleMesh(before, 1234);
 
-	//3. Add device level extensions
-	createInfo.enabledExtensionCount = static_cast<uint32_t>(device_extensions.size());
-	createInfo.ppEnabledExtensionNames = device_extensions.data();
+	Mesh after = before;
+	after.indices = optimizeVertexCache(after.indices, static_cast<uint32_t>(after.vertices.size()), cacheSize);
+	reorderVerticesByFirstUse(after);
+	MeshStreams floatStreams = buildMeshStreams(after, false);
+	MeshStreams quantizedStreams = buildMeshStreams(after, true);
 
-	//4. Add queues - graphics and present
-	QueueFamilyIndices indices = getQueueFamilyIndices(vkPhysicalDevice, vkSurface);
-	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-	std::set<uint32_t> uniqueQueueFamilyIndices = {indices.graphicsFamilyIndex.value(), indices.presentFamilyIndex.value() }; //If both same, only one queue will be formed
-	
-	float queuePriority = 1.0;
-	for (uint32_t uniqueQueueFamily : uniqueQueueFamilyIndices)
+	double checksum = 0.0;
+	double beforeRate = measureTriangleThroughput(before.indices, [&](uint32_t i) { return before.vertices[i].position; }, checksum);
+	double afterRate = measureTriangleThroughput(floatStreams.indices, [&](uint32_t i) { return &floatStreams.positions[i * 3]; }, checksum);
+
+	//Worst normal error the quantization introduced
+	double maxErrorDegrees = 0.0;
+	for (size_t i = 0; i < after.vertices.size(); i++)
 	{
-		VkDeviceQueueCreateInfo queueCreateInfo = {};
-		queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-		queueCreateInfo.queueCount = 1;
-		queueCreateInfo.queueFamilyIndex = uniqueQueueFamily;
-		queueCreateInfo.pQueuePriorities = &queuePriority;
+		float decoded[3];
+		decodeOctahedral(&quantizedStreams.octNormals[i * 2], decoded);
+		const float* normal = after.vertices[i].normal;
+		double cosine = std::clamp(static_cast<double>(decoded[0] * normal[0] + decoded[1] * normal[1] + decoded[2] * normal[2]), -1.0, 1.0);
+		maxErrorDegrees = std::max(maxErrorDegrees, std::acos(cosine) * 180.0 / 3.14159265358979);
+	}
 
-		queueCreateInfos.push_back(queueCreateInfo);
+	size_t interleavedBytes = before.vertices.size() * sizeof(MeshVertex) + before.indices.size() * sizeof(uint32_t);
+	std::cout << scene << ": mesh " << before.vertices.size() << " vertices, " << before.indices.size() / 3 << " triangles" << std::endl;
+	std::cout << scene << ": mesh footprint interleaved " << interleavedBytes << " bytes, streams " << floatStreams.bytes()
+		<< " bytes, quantized streams " << quantizedStreams.bytes() << " bytes (max normal error " << maxErrorDegrees << " deg)" << std::endl;
+	std::cout << scene << ": mesh vertex fetch " << sizeof(MeshVertex) << " bytes interleaved, " << floatStreams.vertexStride()
+		<< " bytes streams, " << quantizedStreams.vertexStride() << " bytes quantized streams" << std::endl;
+	std::cout << scene << ": mesh ACMR (FIFO " << cacheSize << ") " << averageCacheMissRatio(before.indices, cacheSize)
+		<< " before, " << averageCacheMissRatio(after.indices, cacheSize) << " after reordering" << std::endl;
+	std::cout << scene << ": mesh position pass " << beforeRate / 1e6 << " Mtri/s before, " << afterRate / 1e6
+		<< " Mtri/s after (checksum " << checksum << ")" << std::endl;
+}
+
+//Emissive triangles scattered over a ceiling at height 4, facing down. Sizes and radiance are
+//log-normal, so a small fraction of the lights carries most of the power, as in lit interiors.
+std::vector<LightRecord> generateLights(uint32_t count, uint32_t seed)
+{
+	std::mt19937 random(seed);
+	std::uniform_real_distribution<float> position(-8.0f, 8.0f);
+	std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+	std::lognormal_distribution<float> size(-1.5f, 0.5f);
+	std::lognormal_distribution<float> radiance(0.0f, 1.5f);
+
+	std::vector<LightRecord> lights(count);
+	for (auto& light : lights)
+	{
+		float x = position(random);
+		float y = position(random);
+		float r = size(random);
+		float a = angle(random);
+		//Clockwise seen from above, so the geometric normal points down
+		for (int v = 0; v < 3; v++)
+		{
+			float vertexAngle = a - v * 2.0943951f;
+			light.position[v][0] = x + r * std::cos(vertexAngle);
+			light.position[v][1] = y + r * std::sin(vertexAngle);
+			light.position[v][2] = 4.0f;
+		}
+		float intensity = radiance(random);
+		light.emission[0] = light.emission[1] = light.emission[2] = intensity;
 	}
-	
-	createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
-	createInfo.pQueueCreateInfos = queueCreateInfos.data();
+	return lights;
+}
 
-	if (vkCreateDevice(vkPhysicalDevice, &createInfo, nullptr, &vkDevice) != VK_SUCCESS)
+float lightLuminance(const LightRecord& light)
+{
+	return 0.2126f * light.emission[0] + 0.7152f * light.emission[1] + 0.0722f * light.emission[2];
+}
+
+float lightArea(const LightRecord& light)
+{
+	float e1[3], e2[3];
+	for (int i = 0; i < 3; i++)
 	{
-		throw std::runtime_error("Logical Device creation failed");
+		e1[i] = light.position[1][i] - light.position[0][i];
+		e2[i] = light.position[2][i] - light.position[0][i];
 	}
+	float cross[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+	return 0.5f * std::sqrt(cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2]);
+}
 
-	vkGetDeviceQueue(vkDevice, indices.graphicsFamilyIndex.value(), 0, &graphicsQueue);
-	vkGetDeviceQueue(vkDevice, indices.presentFamilyIndex.value(), 0, &presentQueue);
+//Vose's alias method over emitted power (luminance times area). O(n) to build, O(1) to sample.
+void buildLightAliasTable(std::vector<LightRecord>& lights)
+{
+	size_t count = lights.size();
+	std::vector<double> power(count);
+	double total = 0.0;
+	for (size_t i = 0; i < count; i++)
+	{
+		power[i] = static_cast<double>(lightLuminance(lights[i])) * lightArea(lights[i]);
+		total += power[i];
+	}
+	if (total <= 0.0)
+	{
+		std::fill(power.begin(), power.end(), 1.0);
+		total = static_cast<double>(count);
+	}
+
+	//1. Split into lights below and above the average power
+	std::vector<double> scaled(count);
+	std::vector<uint32_t> small, large;
+	for (size_t i = 0; i < count; i++)
+	{
+		lights[i].pdf = static_cast<float>(power[i] / total);
+		scaled[i] = power[i] * count / total;
+		(scaled[i] < 1.0 ? small : large).push_back(static_cast<uint32_t>(i));
+	}
+
+	//2. Fill each small light's column with the remainder of a large one
+	while (!small.empty() && !large.empty())
+	{
+		uint32_t s = small.back();
+		uint32_t l = large.back();
+		small.pop_back();
+		lights[s].aliasProbability = static_cast<float>(scaled[s]);
+		lights[s].alias = l;
+		scaled[l] -= 1.0 - scaled[s];
+		if (scaled[l] < 1.0)
+		{
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+
+	//3. Whatever is left is full up to rounding
+	for (uint32_t i : small) { lights[i].aliasProbability = 1.0f; lights[i].alias = i; }
+	for (uint32_t i : large) { lights[i].aliasProbability = 1.0f; lights[i].alias = i; }
+}
+
+//Exact irradiance (luminance) from a uniformly emitting triangle at a point (Lambert's polygon formula): the sum
+//over the edges of the angle they subtend times the cosine of their plane with the normal
+double lightIrradiance(const LightRecord& light, const double point[3], const double normal[3])
+{
+	double v[3][3];
+	for (int i = 0; i < 3; i++)
+	{
+		double length = 0.0;
+		for (int c = 0; c < 3; c++)
+		{
+			v[i][c] = light.position[i][c] - point[c];
+			length += v[i][c] * v[i][c];
+		}
+		length = std::sqrt(length);
+		for (int c = 0; c < 3; c++) v[i][c] /= length;
+	}
+
+	double sum = 0.0;
+	for (int i = 0; i < 3; i++)
+	{
+		const double* a = v[i];
+		const double* b = v[(i + 1) % 3];
+		double cross[3] = { a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] };
+		double crossLength = std::sqrt(cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2]);
+		if (crossLength == 0.0) continue;
+		double theta = std::acos(std::clamp(a[0] * b[0] + a[1] * b[1] + a[2] * b[2], -1.0, 1.0));
+		sum += theta * (cross[0] * normal[0] + cross[1] * normal[1] + cross[2] * normal[2]) / crossLength;
+	}
+	return 0.5 * lightLuminance(light) * std::abs(sum);
 }
 
+//One next-event estimate of the irradiance at a floor point: pick a light, pick a point on it uniformly
+//by area, weigh the unoccluded contribution by both pdfs
+template<typename PickLight>
+double estimateIrradiance(const std::vector<LightRecord>& lights, const double point[3], std::mt19937& random, PickLight pickLight)
+{
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	double selectionPdf;
+	const LightRecord& light = lights[pickLight(uniform(random), uniform(random), selectionPdf)];
+
+	double u = std::sqrt(uniform(random));
+	double w = uniform(random);
+	double b0 = 1.0 - u, b1 = u * (1.0 - w), b2 = u * w;
+	double d[3];
+	for (int c = 0; c < 3; c++)
+	{
+		d[c] = b0 * light.position[0][c] + b1 * light.position[1][c] + b2 * light.position[2][c] - point[c];
+	}
+	double distance2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+	double distance = std::sqrt(distance2);
+	double cosSurface = d[2] / distance; //floor normal is +z
+	double cosLight = d[2] / distance; //lights face down, towards the floor
+	if (cosSurface <= 0.0)
+	{
+		return 0.0;
+	}
+	return lightLuminance(light) * cosSurface * cosLight / distance2 * lightArea(light) / selectionPdf;
+}
 
-void Engine::createSwapChain()
+//Noise at equal time: both strategies get the same time budget for the same floor points, and their
+//estimates are compared against the exact irradiance
+void benchmarkLightSampling(const std::string& scene, const std::vector<LightRecord>& lights)
 {
-	//1. Get swapchain details from selected physical device
-	SwapChainDetails swapChainDetails = getSwapChainDetails(vkPhysicalDevice, vkSurface);
-	//2. Choose surface format
-	VkSurfaceFormatKHR vkSurfaceFormat;
-	//Choose sRGB format with 8 bits for each component
-	for (const auto& surfaceFormat : swapChainDetails.formats)
+	const uint32_t gridSize = 16;
+	const double budgetMs = 250.0;
+
+	//1. Shading points and their exact irradiance
+	std::vector<std::array<double, 3>> points;
+	std::vector<double> reference;
+	const double normal[3] = { 0.0, 0.0, 1.0 };
+	for (uint32_t y = 0; y < gridSize; y++)
 	{
-		if (surfaceFormat.format == VK_FORMAT_B8G8R8A8_SRGB && surfaceFormat.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR)
+		for (uint32_t x = 0; x < gridSize; x++)
 		{
-			vkSurfaceFormat = surfaceFormat;
+			std::array<double, 3> point = { -8.0 + 16.0 * (x + 0.5) / gridSize, -8.0 + 16.0 * (y + 0.5) / gridSize, 0.0 };
+			double irradiance = 0.0;
+			for (const auto& light : lights) irradiance += lightIrradiance(light, point.data(), normal);
+			points.push_back(point);
+			reference.push_back(irradiance);
 		}
 	}
-	//3. Choose surface present mode
-	VkPresentModeKHR vkPresentMode;
-	//Choose mail box present mode - replace older images from queuw with recent ones if queue is full.
-	for (const auto& presentMode : swapChainDetails.presentModes)
+	double meanReference = 0.0;
+	for (double e : reference) meanReference += e;
+	meanReference /= reference.size();
+
+	//2. Sample every point once per pass until the budget is spent
+	uint32_t count = static_cast<uint32_t>(lights.size());
+	auto run = [&](auto pickLight, uint32_t& passes) {
+		std::mt19937 random(5678);
+		std::vector<double> sums(points.size(), 0.0);
+		passes = 0;
+		auto start = std::chrono::steady_clock::now();
+		while (std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() < budgetMs)
+		{
+			for (size_t i = 0; i < points.size(); i++)
+			{
+				sums[i] += estimateIrradiance(lights, points[i].data(), random, pickLight);
+			}
+			passes++;
+		}
+		double mse = 0.0;
+		for (size_t i = 0; i < points.size(); i++)
+		{
+			double error = sums[i] / passes - reference[i];
+			mse += error * error;
+		}
+		return mse / points.size();
+	};
+
+	uint32_t uniformPasses, aliasPasses;
+	double uniformMse = run([&](double u1, double, double& pdf) {
+		pdf = 1.0 / count;
+		return std::min<uint32_t>(static_cast<uint32_t>(u1 * count), count - 1);
+	}, uniformPasses);
+	double aliasMse = run([&](double u1, double u2, double& pdf) {
+		uint32_t i = std::min<uint32_t>(static_cast<uint32_t>(u1 * count), count - 1);
+		uint32_t picked = u2 < lights[i].aliasProbability ? i : lights[i].alias;
+		pdf = lights[picked].pdf;
+		return picked;
+	}, aliasPasses);
+
+	std::cout << scene << ": lights " << count << " emissive triangles, " << count * sizeof(LightRecord) << " bytes with alias table, "
+		<< points.size() << " points, mean irradiance " << meanReference << std::endl;
+	std::cout << scene << ": light sampling at " << budgetMs << " ms, uniform " << uniformPasses << " spp MSE " << uniformMse
+		<< ", power alias table " << aliasPasses << " spp MSE " << aliasMse << " (" << (aliasMse > 0.0 ? uniformMse / aliasMse : 0.0) << "x less noise)" << std::endl;
+}
+
+bool Engine::finishBenchmark()
+{
+	bool passed = true;
+
+	//1. Image regression
+	if (options.needsCapture())
 	{
-		if (presentMode == VK_PRESENT_MODE_MAILBOX_KHR)
+		void* data;
+		vkMapMemory(vkDevice, captureBufferMemory, 0, VK_WHOLE_SIZE, 0, &data);
+		Image frame = imageFromPixels(static_cast<const uint8_t*>(data), swapChainImageExtent.width, swapChainImageExtent.height, swapChainImageFormat);
+		vkUnmapMemory(vkDevice, captureBufferMemory);
+
+		if (!options.capturePath.empty())
 		{
-			vkPresentMode = presentMode;
+			writePPM(options.capturePath, frame);
+		}
+
+		if (!options.goldenPath.empty())
+		{
+			double rmse = imageRMSE(frame, readPPM(options.goldenPath));
+			std::cout << options.scene << ": RMSE against golden image " << rmse << " (tolerance " << options.tolerance << ")" << std::endl;
+			if (!(rmse <= options.tolerance))
+			{
+				std::cerr << options.scene << ": image regression" << std::endl;
+				passed = false;
+			}
 		}
 	}
-	//4. Choose surface extent
-	VkExtent2D vkExtent;
 
-	if (swapChainDetails.surfaceCapabilities.currentExtent.width != std::numeric_limits<uint32_t>::max())
+	//2. Frame time regression - the first frames include pipeline warm up, skip them
+	size_t warmup = std::min<size_t>(3, frameTimesMs.size() / 4);
+	std::vector<double> times(frameTimesMs.begin() + warmup, frameTimesMs.end());
+	if (times.empty())
 	{
-		vkExtent = swapChainDetails.surfaceCapabilities.currentExtent;
+		return passed;
+	}
+	std::sort(times.begin(), times.end());
+	double median = times[times.size() / 2];
+	double mean = 0.0;
+	for (double t : times) mean += t;
+	mean /= times.size();
+
+	std::cout << options.scene << ": frame sync via " << (useTimelineSemaphore ? "graphics timeline semaphore" : "per-frame fences") << std::endl;
+	std::cout << options.scene << ": render targets via " << (useDynamicRendering ? "dynamic rendering" : "render pass + framebuffers")
+		<< ", recreation " << measureRenderTargetRecreation(100, false) << " ms with dynamic rendering (image views), "
+		<< measureRenderTargetRecreation(100, true) << " ms with render pass + framebuffers" << std::endl;
+	std::cout << options.scene << ": pipeline variants " << variantStats.requests << " requests, " << variantStats.hits << " hits ("
+		<< (variantStats.requests ? 100.0 * variantStats.hits / variantStats.requests : 0.0) << "%), " << variantStats.fallbacks
+		<< " generic fallbacks, " << variantStats.compiled << " compiled in background (" << variantStats.compileMs << " ms not stalled), "
+		<< variantStats.failed << " failed" << std::endl;
+	if (pipelineSwaps > 0)
+	{
+		std::cout << options.scene << ": generic pipeline swapped " << pipelineSwaps << " times without waiting for the device, "
+			<< pipelineSwapMs / pipelineSwaps << " ms per swap" << std::endl;
+	}
+	for (size_t i = 0; i < bands.size(); i++)
+	{
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(i == 0 ? vkPhysicalDevice : peers[i - 1].physicalDevice, &properties);
+		std::cout << options.scene << ": device " << i << " (" << properties.deviceName << ") rows " << bands[i].firstRow << "-" << bands[i].firstRow + bands[i].rowCount
+			<< ", " << (bands[i].timedFrames ? bands[i].totalMs / bands[i].timedFrames : 0.0) << " ms per band" << std::endl;
+	}
+	if (sceneStats.frames > 0)
+	{
+		uint64_t fullBytes = scene.instanceCount() * sizeof(InstanceRecord) + scene.materials.records.size() * sizeof(MaterialRecord)
+			+ scene.lights.records.size() * sizeof(LightRecord);
+		std::cout << options.scene << ": scene " << scene.instanceCount() << " instances, uploads " << sceneStats.uploadedBytes / sceneStats.frames
+			<< " bytes per frame on average (max " << sceneStats.maxFrameBytes << ", full scene " << fullBytes << "), "
+			<< sceneStats.inPlaceUpdates << " in place updates " << sceneStats.updateMs << " ms, "
+			<< sceneStats.rebuilds << " rebuilds " << sceneStats.rebuildMs << " ms" << std::endl;
+	}
+	if (options.meshRings > 0)
+	{
+		benchmarkMeshLayout(options.scene, options.meshRings);
+	}
+	if (options.sceneLights > 0)
+	{
+		benchmarkLightSampling(options.scene, scene.lights.records);
+	}
+	std::cout << options.scene << ": " << times.size() << " frames, median " << median << " ms, mean " << mean << " ms, min " << times.front() << " ms" << std::endl;
+
+	if (!options.historyPath.empty())
+	{
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(vkPhysicalDevice, &properties);
+		std::string runKey = historyRunKey(options.scene, properties.deviceName, swapChainImageExtent, options.deviceCount);
+
+		std::optional<double> baseline = readBaselineFrameTime(options.historyPath, runKey);
+		if (baseline && median > *baseline * (1.0 + options.maxSlowdown))
+		{
+			std::cerr << options.scene << ": frame time regression, median " << median << " ms against " << *baseline << " ms" << std::endl;
+			passed = false;
+		}
+
+		//Only passing runs become the baseline for the next run
+		if (passed)
+		{
+			std::ofstream history(options.historyPath, std::ios::app);
+			history << runKey << "\"frames\":" << times.size() << ",\"medianFrameMs\":" << median
+				<< ",\"meanFrameMs\":" << mean << ",\"minFrameMs\":" << times.front() << "}" << std::endl;
+		}
+	}
+
+	return passed;
+}
+
+void Engine::createExportRing()
+{
+	uint32_t threadCount = options.exportThreads;
+	if (threadCount == 0)
+	{
+		threadCount = std::max(1u, std::thread::hardware_concurrency() / 2);
+	}
+
+	//One slot per frame in flight plus one per encoder, so rendering only stalls when every encoder is behind
+	exportSlots.resize(MAX_FRAMES_IN_FLIGHT + threadCount);
+
+	VkDeviceSize size = static_cast<VkDeviceSize>(swapChainImageExtent.width) * swapChainImageExtent.height * 4;
+	for (auto& slot : exportSlots)
+	{
+		//Cached memory makes the encoders' CPU reads fast, fall back to plain coherent memory
+		try
+		{
+			createBuffer(vkDevice, vkPhysicalDevice, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT, slot.buffer, slot.memory);
+		}
+		catch (const std::runtime_error&)
+		{
+			if (slot.buffer != VK_NULL_HANDLE)
+			{
+				vkDestroyBuffer(vkDevice, slot.buffer, nullptr);
+				slot.buffer = VK_NULL_HANDLE;
+			}
+			createBuffer(vkDevice, vkPhysicalDevice, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, slot.buffer, slot.memory);
+		}
+		vkMapMemory(vkDevice, slot.memory, 0, VK_WHOLE_SIZE, 0, &slot.mapped);
+
+		//Freeing the memory unmaps it implicitly
+		VkBuffer buffer = slot.buffer;
+		VkDeviceMemory memory = slot.memory;
+		keepUntilCleanup("VkDeviceMemory", [this, memory]() { vkFreeMemory(vkDevice, memory, nullptr); });
+		keepUntilCleanup("VkBuffer", [this, buffer]() { vkDestroyBuffer(vkDevice, buffer, nullptr); });
+	}
+
+	exportPool.start(threadCount, static_cast<uint32_t>(exportSlots.size()), [this](uint32_t slot) { encodeExportSlot(slot); });
+}
+
+//Runs on an encoder thread. Only touches the slot it was handed and immutable swapchain info.
+void Engine::encodeExportSlot(uint32_t slot)
+{
+	const ReadbackSlot& readback = exportSlots[slot];
+	const uint8_t* pixels = static_cast<const uint8_t*>(readback.mapped);
+
+	std::string filename;
+	std::string format = options.exportFormat;
+	if (readback.job)
+	{
+		format = readback.job->format;
+		filename = (std::filesystem::path(options.serveDirectory) / (readback.job->id + "." + format)).string();
 	}
 	else
 	{
-		int width, height;
-		glfwGetFramebufferSize(window, &width, &height);
-		vkExtent = { static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+		std::string number = std::to_string(readback.frameIndex);
+		filename = options.exportPrefix + std::string(number.size() < 5 ? 5 - number.size() : 0, '0') + number + "." + format;
 	}
-	vkExtent.width = std::clamp(vkExtent.width, swapChainDetails.surfaceCapabilities.minImageExtent.width, swapChainDetails.surfaceCapabilities.maxImageExtent.width);
-	vkExtent.height = std::clamp(vkExtent.height, swapChainDetails.surfaceCapabilities.minImageExtent.height, swapChainDetails.surfaceCapabilities.maxImageExtent.height);
-	
-	//5. Create swapchain object
-	uint32_t imageCount = swapChainDetails.surfaceCapabilities.minImageCount + 1;
 
-	VkSwapchainCreateInfoKHR createInfo = {};
-	createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
-	createInfo.surface = vkSurface;
-	createInfo.minImageCount = imageCount;
-	createInfo.imageFormat = vkSurfaceFormat.format;
-	createInfo.imageColorSpace = vkSurfaceFormat.colorSpace;
-	createInfo.imageExtent = vkExtent;
-	createInfo.presentMode = vkPresentMode;
-	createInfo.imageArrayLayers = 1; // A 3D stereo image would have additional layer to store depth
-	createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-	createInfo.preTransform = swapChainDetails.surfaceCapabilities.currentTransform; //Flip/rotate/etc.
-	createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-	createInfo.clipped = VK_TRUE;
-	createInfo.oldSwapchain = VK_NULL_HANDLE; //Incase of window resize, new swapchain object needs to be created and oldSwapchain will point to the current swapchain object 
-	
-	QueueFamilyIndices indices = getQueueFamilyIndices(vkPhysicalDevice, vkSurface);
-	uint32_t queueFamilyIndices[] = { indices.graphicsFamilyIndex.value(), indices.presentFamilyIndex.value() };
+	if (format == "raw")
+	{
+		std::ofstream file(filename, std::ios::binary);
+		if (!file.is_open())
+		{
+			throw std::runtime_error("failed to open " + filename + " for writing!");
+		}
+		file.write(reinterpret_cast<const char*>(pixels), static_cast<std::streamsize>(swapChainImageExtent.width) * swapChainImageExtent.height * 4);
+	}
+	else
+	{
+		writePPM(filename, imageFromPixels(pixels, swapChainImageExtent.width, swapChainImageExtent.height, swapChainImageFormat));
+	}
 
-	if (indices.graphicsFamilyIndex != indices.presentFamilyIndex) 
+	//The marker comes last and appears in one rename, so a client never reads a partial image
+	if (readback.job)
 	{
-		createInfo.imageSharingMode = VK_SHARING_MODE_CONCURRENT; //No particular queue family will have ownership of the swapchain
-		createInfo.queueFamilyIndexCount = 2;
-		createInfo.pQueueFamilyIndices = queueFamilyIndices;
+		namespace fs = std::filesystem;
+		fs::path directory(options.serveDirectory);
+		const RenderJob& job = *readback.job;
+		double serverMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - job.claimed).count();
+		{
+			std::ofstream marker(directory / (job.id + ".marker"));
+			marker << "{\"id\":\"" << job.id << "\",\"file\":\"" << job.id << "." << format << "\",\"frame\":" << readback.frameIndex
+				<< ",\"serverMs\":" << serverMs << "}" << std::endl;
+		}
+		fs::rename(directory / (job.id + ".marker"), directory / (job.id + ".done"));
+		fs::remove(directory / (job.id + ".claimed"));
 	}
-	else {
-		createInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+}
+
+void Engine::finishExport()
+{
+	exportPool.stop();
+	double seconds = exportStart ? std::chrono::duration<double>(std::chrono::steady_clock::now() - *exportStart).count() : 0.0;
+
+	if (options.isServer())
+	{
+		std::cout << "served " << jobsServed << " jobs (" << frameCounter << " frames) in " << seconds << " s, "
+			<< variantSwitches << " variant batches, render thread waited " << exportStallMs << " ms on encoders" << std::endl;
+		return;
 	}
 
-	if (vkCreateSwapchainKHR(vkDevice, &createInfo, nullptr, &vkSwapChain) != VK_SUCCESS)
+	std::cout << "exported " << frameCounter << " frames in " << seconds << " s (" << (seconds > 0.0 ? frameCounter / seconds : 0.0)
+		<< " fps sustained), render thread waited " << exportStallMs << " ms on encoders" << std::endl;
+}
+
+//Runs on the pipeline worker during startup, once the generic pipeline exists
+void Engine::createPeerDevices(const ShaderCode& shaderCode)
+{
+	//1. Candidates are all devices with a graphics queue, best ranked first and the presenting device last.
+	//   They are handed out round robin, so one GPU (or lavapipe) can stand in for several.
+	uint32_t count = 0;
+	vkEnumeratePhysicalDevices(vkInstance, &count, nullptr);
+	std::vector<VkPhysicalDevice> availableDevices(count);
+	vkEnumeratePhysicalDevices(vkInstance, &count, availableDevices.data());
+
+	std::vector<VkPhysicalDevice> candidates;
+	for (auto physicalDevice : availableDevices)
 	{
-		throw std::runtime_error("Swap chain creation failed");
+		if (getGraphicsFamilyIndex(physicalDevice).has_value())
+		{
+			candidates.push_back(physicalDevice);
+		}
+	}
+	std::stable_sort(candidates.begin(), candidates.end(), [this](VkPhysicalDevice a, VkPhysicalDevice b) {
+		if ((a == vkPhysicalDevice) != (b == vkPhysicalDevice)) return b == vkPhysicalDevice;
+		return rankPhysicalDevice(a) > rankPhysicalDevice(b);
+	});
+
+	//2. Peers are referenced by address from here on, size the vector once
+	peers.resize(options.deviceCount - 1);
+	for (size_t i = 0; i < peers.size(); i++)
+	{
+		createPeerDevice(peers[i], candidates[i % candidates.size()], shaderCode);
 	}
-											  
-	//6. Create an array to store swapchain images
-	swapChainImageFormat = vkSurfaceFormat.format;
-	swapChainImageExtent = vkExtent;
 
-	vkGetSwapchainImagesKHR(vkDevice, vkSwapChain, &imageCount, nullptr);
-	swapChainImages.resize(imageCount);
-	vkGetSwapchainImagesKHR(vkDevice, vkSwapChain, &imageCount, swapChainImages.data());
+	//3. Staging memory on the presenting device for the composite, one per frame in flight
+	VkDeviceSize size = static_cast<VkDeviceSize>(swapChainImageExtent.width) * swapChainImageExtent.height * 4;
+	for (auto& frame : frames)
+	{
+		createBuffer(vkDevice, vkPhysicalDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, frame.compositeBuffer, frame.compositeMemory);
+		vkMapMemory(vkDevice, frame.compositeMemory, 0, VK_WHOLE_SIZE, 0, &frame.compositeMapped);
+
+		VkBuffer buffer = frame.compositeBuffer;
+		VkDeviceMemory memory = frame.compositeMemory;
+		keepUntilCleanup("VkDeviceMemory", [this, memory]() { vkFreeMemory(vkDevice, memory, nullptr); });
+		keepUntilCleanup("VkBuffer", [this, buffer]() { vkDestroyBuffer(vkDevice, buffer, nullptr); });
+	}
+
+	//4. Timestamps around the presenting device's own band
+	timestampPool = createTimestampPool(vkDevice, vkPhysicalDevice, queueFamilyIndices.graphicsFamilyIndex.value(), 2 * MAX_FRAMES_IN_FLIGHT, timestampPeriod);
+	if (timestampPool != VK_NULL_HANDLE)
+	{
+		VkQueryPool queryPool = timestampPool;
+		keepUntilCleanup("VkQueryPool", [this, queryPool]() { vkDestroyQueryPool(vkDevice, queryPool, nullptr); });
+	}
+
+	//5. Even split until every device has been timed
+	bands.resize(peers.size() + 1);
+	balanceBands();
+}
+
+void Engine::createPeerDevice(PeerDevice& peer, VkPhysicalDevice physicalDevice, const ShaderCode& shaderCode)
+{
+	peer.physicalDevice = physicalDevice;
+	uint32_t queueFamily = getGraphicsFamilyIndex(physicalDevice).value();
+
+	//1. Logical device with a single graphics queue, no presentation
+	float queuePriority = 1.0f;
+	VkDeviceQueueCreateInfo queueCreateInfo{};
+	queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+	queueCreateInfo.queueFamilyIndex = queueFamily;
+	queueCreateInfo.queueCount = 1;
+	queueCreateInfo.pQueuePriorities = &queuePriority;
+
+	VkPhysicalDeviceFeatures deviceFeatures{};
+	VkDeviceCreateInfo createInfo{};
+	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+	createInfo.queueCreateInfoCount = 1;
+	createInfo.pQueueCreateInfos = &queueCreateInfo;
+	createInfo.pEnabledFeatures = &deviceFeatures;
+	createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
+	createInfo.ppEnabledLayerNames = validationLayers.data();
+
+	if (vkCreateDevice(physicalDevice, &createInfo, nullptr, &peer.device) != VK_SUCCESS)
+	{
+		throw std::runtime_error("Peer device creation failed");
+	}
+	vkGetDeviceQueue(peer.device, queueFamily, 0, &peer.queue);
+	VkDevice device = peer.device;
+
+	//2. Render pass and pipeline for the requested variant. The render pass leaves the image ready for the readback copy.
+	peer.pipelineTarget = createPipelineTarget(device, shaderCode);
+	peer.pipelineTarget.renderPass = buildRenderPass(device, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+	peer.pipelineTarget.colorFormat = swapChainImageFormat;
+	const PipelineTarget& target = peer.pipelineTarget;
+	keepUntilPeerCleanup(peer, "VkShaderModule", [device, target]() { vkDestroyShaderModule(device, target.vertShaderModule, nullptr); });
+	keepUntilPeerCleanup(peer, "VkShaderModule", [device, target]() { vkDestroyShaderModule(device, target.fragShaderModule, nullptr); });
+	keepUntilPeerCleanup(peer, "VkPipelineLayout", [device, target]() { vkDestroyPipelineLayout(device, target.layout, nullptr); });
+	keepUntilPeerCleanup(peer, "VkRenderPass", [device, target]() { vkDestroyRenderPass(device, target.renderPass, nullptr); });
+
+	VkPipeline startupPipeline = buildGraphicsPipeline(options.variant, peer.pipelineTarget);
+	keepUntilPeerCleanup(peer, "VkPipeline", [device, startupPipeline]() { vkDestroyPipeline(device, startupPipeline, nullptr); });
+	peer.pipelines[options.variant] = startupPipeline;
+	peer.startupPipeline = startupPipeline;
+
+	//3. Offscreen color image, same size and format as the swapchain so the bands line up
+	VkImageCreateInfo imageInfo{};
+	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	imageInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageInfo.format = swapChainImageFormat;
+	imageInfo.extent = { swapChainImageExtent.width, swapChainImageExtent.height, 1 };
+	imageInfo.mipLevels = 1;
+	imageInfo.arrayLayers = 1;
+	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	if (vkCreateImage(device, &imageInfo, nullptr, &peer.image) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create peer image!");
+	}
+
+	VkMemoryRequirements memRequirements;
+	vkGetImageMemoryRequirements(device, peer.image, &memRequirements);
+
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = memRequirements.size;
+	allocInfo.memoryTypeIndex = findMemoryType(physicalDevice, memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	if (vkAllocateMemory(device, &allocInfo, nullptr, &peer.imageMemory) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to allocate peer image memory!");
+	}
+	vkBindImageMemory(device, peer.image, peer.imageMemory, 0);
+
+	VkImage image = peer.image;
+	VkDeviceMemory imageMemory = peer.imageMemory;
+	keepUntilPeerCleanup(peer, "VkDeviceMemory", [device, imageMemory]() { vkFreeMemory(device, imageMemory, nullptr); });
+	keepUntilPeerCleanup(peer, "VkImage", [device, image]() { vkDestroyImage(device, image, nullptr); });
+
+	VkImageViewCreateInfo viewInfo{};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = peer.image;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewInfo.format = swapChainImageFormat;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	viewInfo.subresourceRange.baseMipLevel = 0;
+	viewInfo.subresourceRange.levelCount = 1;
+	viewInfo.subresourceRange.baseArrayLayer = 0;
+	viewInfo.subresourceRange.layerCount = 1;
+
+	if (vkCreateImageView(device, &viewInfo, nullptr, &peer.imageView) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create peer image view!");
+	}
+	VkImageView imageView = peer.imageView;
+	keepUntilPeerCleanup(peer, "VkImageView", [device, imageView]() { vkDestroyImageView(device, imageView, nullptr); });
+
+	peer.framebuffer = buildFramebuffer(device, peer.pipelineTarget.renderPass, peer.imageView);
+	VkFramebuffer framebuffer = peer.framebuffer;
+	keepUntilPeerCleanup(peer, "VkFramebuffer", [device, framebuffer]() { vkDestroyFramebuffer(device, framebuffer, nullptr); });
+
+	//4. Readback buffer, mapped for the whole run. Freeing the memory unmaps it.
+	VkDeviceSize size = static_cast<VkDeviceSize>(swapChainImageExtent.width) * swapChainImageExtent.height * 4;
+	createBuffer(device, physicalDevice, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, peer.readbackBuffer, peer.readbackMemory);
+	vkMapMemory(device, peer.readbackMemory, 0, VK_WHOLE_SIZE, 0, &peer.readbackMapped);
+
+	VkBuffer readbackBuffer = peer.readbackBuffer;
+	VkDeviceMemory readbackMemory = peer.readbackMemory;
+	keepUntilPeerCleanup(peer, "VkDeviceMemory", [device, readbackMemory]() { vkFreeMemory(device, readbackMemory, nullptr); });
+	keepUntilPeerCleanup(peer, "VkBuffer", [device, readbackBuffer]() { vkDestroyBuffer(device, readbackBuffer, nullptr); });
+
+	//5. Command buffer, fence and timestamps. One band is in flight at a time, it is collected within the same frame.
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	poolInfo.queueFamilyIndex = queueFamily;
+
+	if (vkCreateCommandPool(device, &poolInfo, nullptr, &peer.commandPool) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create peer command pool!");
+	}
+	VkCommandPool commandPool = peer.commandPool;
+	keepUntilPeerCleanup(peer, "VkCommandPool", [device, commandPool]() { vkDestroyCommandPool(device, commandPool, nullptr); });
+
+	VkCommandBufferAllocateInfo commandBufferInfo{};
+	commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	commandBufferInfo.commandPool = peer.commandPool;
+	commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	commandBufferInfo.commandBufferCount = 1;
+
+	if (vkAllocateCommandBuffers(device, &commandBufferInfo, &peer.commandBuffer) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to allocate peer command buffer!");
+	}
+
+	VkFenceCreateInfo fenceInfo{};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	if (vkCreateFence(device, &fenceInfo, nullptr, &peer.fence) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create peer fence!");
+	}
+	VkFence fence = peer.fence;
+	keepUntilPeerCleanup(peer, "VkFence", [device, fence]() { vkDestroyFence(device, fence, nullptr); });
+
+	peer.timestampPool = createTimestampPool(device, physicalDevice, queueFamily, 2, peer.timestampPeriod);
+	if (peer.timestampPool != VK_NULL_HANDLE)
+	{
+		VkQueryPool queryPool = peer.timestampPool;
+		keepUntilPeerCleanup(peer, "VkQueryPool", [device, queryPool]() { vkDestroyQueryPool(device, queryPool, nullptr); });
+	}
 }
 
-void Engine::createImageViews()
+//Same bookkeeping as keepUntilCleanup(), for objects that have to go before their peer device
+void Engine::keepUntilPeerCleanup(PeerDevice& peer, const std::string& type, std::function<void()>&& destroy)
 {
-	swapChainImageViews.resize(swapChainImages.size());
+	std::lock_guard<std::mutex> lock(lifetimeMutex);
+	liveObjects.created(type);
+	peer.deletionQueue.push([this, type, destroy]() {
+		destroy();
+		liveObjects.destroyed(type);
+	});
+}
 
-	for (size_t i = 0; i < swapChainImages.size(); i++)
+//Peers follow the presenting device's variant, which a server changes per job. Like the presenting device, a peer
+//never blocks on a compile: a variant new to it is built on a worker and the band keeps the startup variant meanwhile.
+VkPipeline Engine::getPeerPipeline(PeerDevice& peer, const PipelineVariantKey& key)
+{
+	auto pending = peer.pendingPipelines.find(key);
+	if (pending != peer.pendingPipelines.end() && pending->second.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
 	{
-		VkImageViewCreateInfo createInfo = {};
-
-		/*createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-		createInfo.image = swapChainImages[i];
-		createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-		createInfo.format = swapChainImageFormat;
-		createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		createInfo.subresourceRange.layerCount = 1;
-		createInfo.subresourceRange.baseArrayLayer = 0;
-		createInfo.subresourceRange.levelCount = 1;
-		createInfo.subresourceRange.baseMipLevel = 0;*/
-
-		createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-		createInfo.image = swapChainImages[i];
-		createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-		createInfo.format = swapChainImageFormat;
-		createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		createInfo.subresourceRange.baseMipLevel = 0;
-		createInfo.subresourceRange.levelCount = 1;
-		createInfo.subresourceRange.baseArrayLayer = 0;
-		createInfo.subresourceRange.layerCount = 1;
-
-		if(vkCreateImageView(vkDevice, &createInfo, nullptr, &swapChainImageViews[i]) != VK_SUCCESS)
+		try
+		{
+			peer.pipelines[key] = pending->second.get();
+		}
+		catch (const std::exception& e)
 		{
-			throw std::runtime_error("SwapChain Imageview cannot be created!!!!!");
+			std::cerr << "peer pipeline variant " << key.sampleCount << "," << key.bounceDepth << "," << key.featureBits
+				<< " failed to compile, drawing the startup variant instead: " << e.what() << std::endl;
+			peer.failedPipelines.insert(key);
 		}
+		peer.pendingPipelines.erase(pending);
+	}
+	else if (pending == peer.pendingPipelines.end() && peer.pipelines.count(key) == 0 && peer.failedPipelines.count(key) == 0)
+	{
+		//Peers are only added at startup, so the reference stays valid until cleanup has waited on this compile
+		PeerDevice* compilingPeer = &peer;
+		peer.pendingPipelines[key] = std::async(std::launch::async, [this, compilingPeer, key]() {
+			VkDevice device = compilingPeer->device;
+			VkPipeline pipeline = buildGraphicsPipeline(key, compilingPeer->pipelineTarget);
+			keepUntilPeerCleanup(*compilingPeer, "VkPipeline", [device, pipeline]() { vkDestroyPipeline(device, pipeline, nullptr); });
+			return pipeline;
+		});
 	}
+
+	auto ready = peer.pipelines.find(key);
+	return ready != peer.pipelines.end() ? ready->second : peer.startupPipeline;
 }
 
-static std::vector<char> readFile(const std::string& filename) 
+void Engine::renderPeerBands()
 {
-	std::ifstream file(filename, std::ios::ate | std::ios::binary);
-
-	if (!file.is_open()) 
+	for (size_t i = 0; i < peers.size(); i++)
 	{
-		throw std::runtime_error("failed to open file!");
-	}
+		PeerDevice& peer = peers[i];
+		const RenderBand& band = bands[i + 1];
+		peer.submittedFirstRow = band.firstRow;
+		peer.submittedRows = band.rowCount;
+		if (band.rowCount == 0)
+		{
+			continue;
+		}
 
-	size_t fileSize = (size_t)file.tellg();
-	std::vector<char> buffer(fileSize);
+		VkCommandBuffer commandBuffer = peer.commandBuffer;
+		vkResetCommandBuffer(commandBuffer, 0);
 
-	file.seekg(0);
-	file.read(buffer.data(), fileSize);
-	file.close();
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+		{
+			throw std::runtime_error("failed to begin recording peer command buffer!");
+		}
 
-	return buffer;
-}
+		if (peer.timestampPool != VK_NULL_HANDLE)
+		{
+			vkCmdResetQueryPool(commandBuffer, peer.timestampPool, 0, 2);
+			vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, peer.timestampPool, 0);
+		}
 
-VkShaderModule createShaderModule(const std::vector<char>& code, const VkDevice &vkDevice)
-{
-	VkShaderModule shaderModule;
+		//1. Clear and draw the band only, with the full frame viewport so it lines up with the other bands
+		VkRect2D bandArea{};
+		bandArea.offset = { 0, static_cast<int32_t>(band.firstRow) };
+		bandArea.extent = { swapChainImageExtent.width, band.rowCount };
+
+		VkClearValue clearColor = { {{0.0f, 0.0f, 0.0f, 1.0f}} };
+		VkRenderPassBeginInfo renderPassInfo{};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = peer.pipelineTarget.renderPass;
+		renderPassInfo.framebuffer = peer.framebuffer;
+		renderPassInfo.renderArea = bandArea;
+		renderPassInfo.clearValueCount = 1;
+		renderPassInfo.pClearValues = &clearColor;
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getPeerPipeline(peer, options.variant));
+		VkViewport viewport{};
+		viewport.x = 0.0f;
+		viewport.y = 0.0f;
+		viewport.width = static_cast<float>(swapChainImageExtent.width);
+		viewport.height = static_cast<float>(swapChainImageExtent.height);
+		viewport.minDepth = 0.0f;
+		viewport.maxDepth = 1.0f;
+		vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+		vkCmdSetScissor(commandBuffer, 0, 1, &bandArea);
+		vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+		vkCmdEndRenderPass(commandBuffer);
+
+		//2. Copy the band into the readback buffer, tightly packed from offset 0
+		transitionImageLayout(commandBuffer, peer.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+		VkBufferImageCopy region{};
+		region.bufferOffset = 0;
+		region.bufferRowLength = 0;
+		region.bufferImageHeight = 0;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = 0;
+		region.imageSubresource.baseArrayLayer = 0;
+		region.imageSubresource.layerCount = 1;
+		region.imageOffset = { 0, static_cast<int32_t>(band.firstRow), 0 };
+		region.imageExtent = { swapChainImageExtent.width, band.rowCount, 1 };
+		vkCmdCopyImageToBuffer(commandBuffer, peer.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, peer.readbackBuffer, 1, &region);
+
+		VkBufferMemoryBarrier hostBarrier{};
+		hostBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+		hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		hostBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		hostBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		hostBarrier.buffer = peer.readbackBuffer;
+		hostBarrier.offset = 0;
+		hostBarrier.size = VK_WHOLE_SIZE;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &hostBarrier, 0, nullptr);
+
+		if (peer.timestampPool != VK_NULL_HANDLE)
+		{
+			vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, peer.timestampPool, 1);
+		}
 
-	VkShaderModuleCreateInfo createInfo = {};
-	createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-	createInfo.codeSize = code.size();
-	createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+		if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+		{
+			throw std::runtime_error("failed to record peer command buffer!");
+		}
 
-	if (vkCreateShaderModule(vkDevice, &createInfo, nullptr, &shaderModule) != VK_SUCCESS)
-	{
-		throw std::runtime_error("Error creating shader module");
+		VkSubmitInfo submitInfo{};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &commandBuffer;
+		if (vkQueueSubmit(peer.queue, 1, &submitInfo, peer.fence) != VK_SUCCESS)
+		{
+			throw std::runtime_error("failed to submit peer band!");
+		}
 	}
-
-	return shaderModule;
 }
 
-void Engine::createGraphicsPipeline()
+//Stages the band every peer rendered during the previous frame in this frame's composite buffer. It has had a
+//whole frame to finish, so the fence wait rarely blocks. The frame slot has been waited on, so the buffer is free.
+void Engine::collectPeerBands(FrameData& frame)
 {
-	auto vertShaderCode = readFile("vert.spv");
-	auto fragShaderCode = readFile("frag.spv");
-
-	VkShaderModule vertShaderModule = createShaderModule(vertShaderCode, vkDevice);
-	VkShaderModule fragShaderModule = createShaderModule(fragShaderCode, vkDevice);
+	size_t rowPitch = static_cast<size_t>(swapChainImageExtent.width) * 4;
 
-	//1. Create shader stage - Vertex
-	VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
-	vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-	vertShaderStageInfo.module = vertShaderModule;
-	vertShaderStageInfo.pName = "main";
-	vkDestroyShaderModule(vkDevice, vertShaderModule, nullptr);
+	for (size_t i = 0; i < peers.size(); i++)
+	{
+		PeerDevice& peer = peers[i];
+		peer.stagedRows = 0;
+		if (peer.submittedRows == 0)
+		{
+			continue;
+		}
 
-	//2. Create shader stage - Fragment
-	VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
-	fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-	fragShaderStageInfo.module = fragShaderModule;
-	fragShaderStageInfo.pName = "main";
-	vkDestroyShaderModule(vkDevice, fragShaderModule, nullptr);
-	
-	VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo, fragShaderStageInfo };
+		vkWaitForFences(peer.device, 1, &peer.fence, VK_TRUE, UINT64_MAX);
+		vkResetFences(peer.device, 1, &peer.fence);
 
-	//3. Set dynamic state
-	std::vector<VkDynamicState> dynamicStates = {
-		VK_DYNAMIC_STATE_VIEWPORT,
-		VK_DYNAMIC_STATE_SCISSOR
-	};
+		if (peer.timestampPool != VK_NULL_HANDLE)
+		{
+			std::optional<double> bandMs = readTimestampMs(peer.device, peer.timestampPool, 0, peer.timestampPeriod);
+			if (bandMs)
+			{
+				bands[i + 1].addSample(*bandMs, peer.submittedRows);
+			}
+		}
 
-	VkPipelineDynamicStateCreateInfo dynamicState{};
-	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-	dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
-	dynamicState.pDynamicStates = dynamicStates.data();
+		memcpy(static_cast<uint8_t*>(frame.compositeMapped) + peer.submittedFirstRow * rowPitch, peer.readbackMapped, peer.submittedRows * rowPitch);
+		peer.stagedFirstRow = peer.submittedFirstRow;
+		peer.stagedRows = peer.submittedRows;
+		peer.submittedRows = 0;
+	}
+}
 
+//Copies the staged peer bands over the presenting device's frame, which is in PRESENT_SRC after rendering
+void Engine::recordComposite(VkCommandBuffer commandBuffer, uint32_t imageIndex)
+{
+	VkDeviceSize rowPitch = static_cast<VkDeviceSize>(swapChainImageExtent.width) * 4;
 
-	//4. Create vertex input state
-	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
-	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	vertexInputInfo.vertexBindingDescriptionCount = 0;
-	vertexInputInfo.vertexAttributeDescriptionCount = 0;
-	
-	//5. Create Input assembly
-	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
-	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-	inputAssembly.primitiveRestartEnable = VK_FALSE;
+	std::vector<VkBufferImageCopy> regions;
+	for (const auto& peer : peers)
+	{
+		if (peer.stagedRows == 0)
+		{
+			continue;
+		}
 
-	//6. Set viewport
-	VkPipelineViewportStateCreateInfo viewportState{};
-	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-	viewportState.viewportCount = 1;
-	viewportState.scissorCount = 1;
+		VkBufferImageCopy region{};
+		region.bufferOffset = peer.stagedFirstRow * rowPitch;
+		region.bufferRowLength = 0;
+		region.bufferImageHeight = 0;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = 0;
+		region.imageSubresource.baseArrayLayer = 0;
+		region.imageSubresource.layerCount = 1;
+		region.imageOffset = { 0, static_cast<int32_t>(peer.stagedFirstRow), 0 };
+		region.imageExtent = { swapChainImageExtent.width, peer.stagedRows, 1 };
+		regions.push_back(region);
+	}
 
-	//7. Set rasterizer
-	VkPipelineRasterizationStateCreateInfo rasterizer{};
-	rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-	rasterizer.depthClampEnable = VK_FALSE; // clamp to near/ far planes?
-	rasterizer.rasterizerDiscardEnable = VK_FALSE; //if true geometry never passes to this stage
-	rasterizer.polygonMode = VK_POLYGON_MODE_FILL; //
-	rasterizer.lineWidth = 1.0f;
-	rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-	rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
-	rasterizer.depthBiasEnable = VK_FALSE;
-	/*rasterizer.depthBiasConstantFactor = 0.0f; // Optional
-	rasterizer.depthBiasClamp = 0.0f; // Optional
-	rasterizer.depthBiasSlopeFactor = 0.0f; // Optional*/
+	if (regions.empty())
+	{
+		return;
+	}
 
-	//8. Set multisampling
-	VkPipelineMultisampleStateCreateInfo multisampling{};
-	multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-	multisampling.sampleShadingEnable = VK_FALSE;
-	multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+	transitionImageLayout(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
 
-	//9. Set color blending
-	VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-	colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-	colorBlendAttachment.blendEnable = VK_FALSE;
+	vkCmdCopyBufferToImage(commandBuffer, frames[currentFrame].compositeBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		static_cast<uint32_t>(regions.size()), regions.data());
 
-	VkPipelineColorBlendStateCreateInfo colorBlending{};
-	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-	colorBlending.logicOpEnable = VK_FALSE;
-	colorBlending.logicOp = VK_LOGIC_OP_COPY;
-	colorBlending.attachmentCount = 1;
-	colorBlending.pAttachments = &colorBlendAttachment;
-	colorBlending.blendConstants[0] = 0.0f;
-	colorBlending.blendConstants[1] = 0.0f;
-	colorBlending.blendConstants[2] = 0.0f;
-	colorBlending.blendConstants[3] = 0.0f;
+	transitionImageLayout(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+		VK_ACCESS_TRANSFER_WRITE_BIT, 0, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+}
 
-	//10. Create pipeline layout
-	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-	pipelineLayoutInfo.setLayoutCount = 0;
-	pipelineLayoutInfo.pushConstantRangeCount = 0;
+//Splits the frame height in proportion to each device's measured speed (rows per ms of GPU time).
+//The split stays even until every device has been timed. Every band keeps at least one row so it
+//keeps being measured.
+void Engine::balanceBands()
+{
+	uint32_t height = swapChainImageExtent.height;
+	uint32_t bandCount = static_cast<uint32_t>(bands.size());
+	uint32_t minRows = height >= bandCount ? 1 : 0;
+	uint32_t spareRows = height - minRows * bandCount;
 
-	if (vkCreatePipelineLayout(vkDevice, &pipelineLayoutInfo, nullptr, &vkPipelineLayout) != VK_SUCCESS) {
-		throw std::runtime_error("failed to create pipeline layout!");
+	bool measured = true;
+	for (const auto& band : bands)
+	{
+		measured = measured && band.msPerRow > 0.0;
 	}
 
-	//11. Create pipeline
-	VkGraphicsPipelineCreateInfo pipelineInfo{};
-	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-	pipelineInfo.stageCount = 2;
-	pipelineInfo.pStages = shaderStages;
-	pipelineInfo.pVertexInputState = &vertexInputInfo;
-	pipelineInfo.pInputAssemblyState = &inputAssembly;
-	pipelineInfo.pViewportState = &viewportState;
-	pipelineInfo.pRasterizationState = &rasterizer;
-	pipelineInfo.pMultisampleState = &multisampling;
-	pipelineInfo.pColorBlendState = &colorBlending;
-	pipelineInfo.pDynamicState = &dynamicState;
-	pipelineInfo.layout = vkPipelineLayout;
-	pipelineInfo.renderPass = vkRenderPass;
-	pipelineInfo.subpass = 0;
-	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
-
-	if (vkCreateGraphicsPipelines(vkDevice, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &vkGraphicsPipeline) != VK_SUCCESS)
+	std::vector<double> weights(bandCount, 1.0);
+	double totalWeight = 0.0;
+	for (uint32_t i = 0; i < bandCount; i++)
 	{
-		throw std::runtime_error("failed to create graphics pipeline!");
+		if (measured)
+		{
+			weights[i] = 1.0 / bands[i].msPerRow;
+		}
+		totalWeight += weights[i];
 	}
 
+	uint32_t firstRow = 0;
+	for (uint32_t i = 0; i < bandCount; i++)
+	{
+		uint32_t rows = i + 1 == bandCount ? height - firstRow : minRows + static_cast<uint32_t>(spareRows * weights[i] / totalWeight);
+		bands[i].firstRow = firstRow;
+		bands[i].rowCount = rows;
+		firstRow += rows;
+	}
 }
 
-void Engine::createRenderPass()
+//Test scene: a grid of instances cycling through a few materials
+void Engine::populateScene()
 {
-	VkAttachmentDescription colorAttachment{};
-	colorAttachment.format = swapChainImageFormat;
-	colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-	colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-	colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-	colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-	colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-	colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	
-	VkAttachmentReference colorAttachmentRef{};
-	colorAttachmentRef.attachment = 0;
-	colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-	
-	VkSubpassDescription subpass{};
-	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-	subpass.colorAttachmentCount = 1;
-	subpass.pColorAttachments = &colorAttachmentRef;
-
-	VkRenderPassCreateInfo renderPassInfo{};
-	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-	renderPassInfo.attachmentCount = 1;
-	renderPassInfo.pAttachments = &colorAttachment;
-	renderPassInfo.subpassCount = 1;
-	renderPassInfo.pSubpasses = &subpass;
+	const float colors[][4] = { { 1.0f, 0.2f, 0.2f, 1.0f }, { 0.2f, 1.0f, 0.2f, 1.0f }, { 0.2f, 0.2f, 1.0f, 1.0f }, { 1.0f, 1.0f, 1.0f, 1.0f } };
+	for (const auto& color : colors)
+	{
+		MaterialRecord material;
+		memcpy(material.baseColor, color, sizeof(material.baseColor));
+		scene.addMaterial(material);
+	}
 
-	if (vkCreateRenderPass(vkDevice, &renderPassInfo, nullptr, &vkRenderPass) != VK_SUCCESS) 
+	uint32_t columns = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(options.sceneInstances))));
+	for (uint32_t i = 0; i < options.sceneInstances; i++)
 	{
-		throw std::runtime_error("failed to create render pass!");
+		InstanceRecord instance;
+		instance.transform[0][3] = static_cast<float>(i % columns);
+		instance.transform[1][3] = static_cast<float>(i / columns);
+		instance.materialIndex = i % 4;
+		sceneInstanceIds.push_back(scene.addInstance(instance));
 	}
+
+	//Built once at load, uploaded with the first frame's scene update
+	std::vector<LightRecord> lights = generateLights(options.sceneLights, 1234);
+	buildLightAliasTable(lights);
+	scene.setLights(lights);
 }
 
-void Engine::createFramebuffers() {
-	swapChainFramebuffers.resize(swapChainImageViews.size());
+//Moves options.movingInstances instances per frame, round robin, so only their records change
+void Engine::animateScene()
+{
+	uint32_t count = static_cast<uint32_t>(sceneInstanceIds.size());
+	if (count == 0)
+	{
+		return;
+	}
 
-	for (size_t i = 0; i < swapChainImageViews.size(); i++) 
+	float offset = 0.1f * std::sin(frameCounter * 0.05f);
+	for (uint32_t i = 0; i < options.movingInstances && i < count; i++)
 	{
-		VkImageView attachments[] = 
-		{
-			swapChainImageViews[i]
-		};
+		uint32_t id = sceneInstanceIds[(frameCounter * options.movingInstances + i) % count];
+		float transform[3][4] = { { 1.0f, 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f, offset } };
+		scene.setTransform(id, transform);
+	}
+}
 
-		VkFramebufferCreateInfo framebufferInfo{};
-		framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-		framebufferInfo.renderPass = vkRenderPass;
-		framebufferInfo.attachmentCount = 1;
-		framebufferInfo.pAttachments = attachments;
-		framebufferInfo.width = swapChainImageExtent.width;
-		framebufferInfo.height = swapChainImageExtent.height;
-		framebufferInfo.layers = 1;
+//Replaces options.churnInstances instances per frame, round robin, and edits materials. Each removal
+//moves the last record into the freed slot, so the upload covers that slot plus the appended record.
+void Engine::churnScene()
+{
+	uint32_t count = static_cast<uint32_t>(sceneInstanceIds.size());
+	uint32_t materialCount = static_cast<uint32_t>(scene.materials.records.size());
+	if (count == 0)
+	{
+		return;
+	}
 
-		if (vkCreateFramebuffer(vkDevice, &framebufferInfo, nullptr, &swapChainFramebuffers[i]) != VK_SUCCESS) 
-		{
-			throw std::runtime_error("failed to create framebuffer!");
-		}
+	uint32_t columns = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(count))));
+	for (uint32_t i = 0; i < options.churnInstances && i < count; i++)
+	{
+		//1. The replacement takes over the removed instance's grid cell under a new id
+		uint32_t cell = (frameCounter * options.churnInstances + i) % count;
+		scene.removeInstance(sceneInstanceIds[cell]);
+
+		InstanceRecord instance;
+		instance.transform[0][3] = static_cast<float>(cell % columns);
+		instance.transform[1][3] = static_cast<float>(cell / columns);
+		instance.materialIndex = (cell + frameCounter) % materialCount;
+		sceneInstanceIds[cell] = scene.addInstance(instance);
+
+		//2. Its neighbour switches material, wherever its record ended up
+		scene.setInstanceMaterial(sceneInstanceIds[(cell + 1) % count], frameCounter % materialCount);
 	}
+
+	//3. One material changes per frame
+	uint32_t material = frameCounter % materialCount;
+	MaterialRecord record = scene.materials.records[material];
+	record.roughness = 0.5f + 0.5f * std::sin(frameCounter * 0.05f);
+	scene.setMaterial(material, record);
 }
 
-void Engine::createCommandPool() 
+//Returns true when the buffer had to be reallocated. The old one is retired with the current frame,
+//which is the last one that can still read it.
+bool Engine::reserveSceneBuffer(SceneBuffer& sceneBuffer, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties)
 {
-	QueueFamilyIndices queueFamilyIndices = getQueueFamilyIndices(vkPhysicalDevice, vkSurface);
+	if (size <= sceneBuffer.capacity)
+	{
+		return false;
+	}
 
-	VkCommandPoolCreateInfo poolInfo{};
-	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-	poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamilyIndex.value();
+	releaseSceneBuffer(sceneBuffer);
 
-	if (vkCreateCommandPool(vkDevice, &poolInfo, nullptr, &vkCommandPool) != VK_SUCCESS) 
+	//Grow geometrically so a growing scene does not reallocate every frame
+	VkDeviceSize capacity = std::max<VkDeviceSize>(size, 2 * sceneBuffer.capacity);
+	createBuffer(vkDevice, vkPhysicalDevice, capacity, usage, properties, sceneBuffer.buffer, sceneBuffer.memory);
+	sceneBuffer.capacity = capacity;
+	if (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
 	{
-		throw std::runtime_error("failed to create command pool!");
+		vkMapMemory(vkDevice, sceneBuffer.memory, 0, VK_WHOLE_SIZE, 0, &sceneBuffer.mapped);
 	}
+
+	std::lock_guard<std::mutex> lock(lifetimeMutex);
+	liveObjects.created("VkDeviceMemory");
+	liveObjects.created("VkBuffer");
+	return true;
 }
 
-void Engine::createCommandBuffer() 
+void Engine::releaseSceneBuffer(SceneBuffer& sceneBuffer)
 {
-	VkCommandBufferAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	allocInfo.commandPool = vkCommandPool;
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	allocInfo.commandBufferCount = 1;
-
-	if (vkAllocateCommandBuffers(vkDevice, &allocInfo, &vkCommandBuffer) != VK_SUCCESS) 
+	if (sceneBuffer.buffer == VK_NULL_HANDLE)
 	{
-		throw std::runtime_error("failed to allocate command buffers!");
+		return;
 	}
+
+	VkBuffer buffer = sceneBuffer.buffer;
+	VkDeviceMemory memory = sceneBuffer.memory;
+	retire("VkBuffer", [this, buffer]() { vkDestroyBuffer(vkDevice, buffer, nullptr); });
+	retire("VkDeviceMemory", [this, memory]() { vkFreeMemory(vkDevice, memory, nullptr); });
+	sceneBuffer = SceneBuffer{};
 }
 
-void Engine::recordCommandBuffer(uint32_t imageIndex) 
+//Uploads the records changed since the last frame. The device buffers are updated in place and only
+//reallocated (a rebuild, everything is uploaded again) when the scene no longer fits.
+void Engine::recordSceneUpload(VkCommandBuffer commandBuffer)
 {
-	VkCommandBufferBeginInfo beginInfo{};
-	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	beginInfo.flags = 0; // Optional
-	beginInfo.pInheritanceInfo = nullptr; // Optional
-
-	if (vkBeginCommandBuffer(vkCommandBuffer, &beginInfo) != VK_SUCCESS) {
-		throw std::runtime_error("failed to begin recording command buffer!");
+	auto start = std::chrono::steady_clock::now();
+
+	//1. Rebuild if the scene outgrew its buffers
+	VkBufferUsageFlags deviceUsage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	bool rebuilt = reserveSceneBuffer(instanceBuffer, std::max<size_t>(1, scene.instanceCount()) * sizeof(InstanceRecord), deviceUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	rebuilt = reserveSceneBuffer(materialBuffer, std::max<size_t>(1, scene.materials.records.size()) * sizeof(MaterialRecord), deviceUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) || rebuilt;
+	rebuilt = reserveSceneBuffer(lightBuffer, std::max<size_t>(1, scene.lights.records.size()) * sizeof(LightRecord), deviceUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) || rebuilt;
+	if (rebuilt)
+	{
+		scene.instances.markAllDirty();
+		scene.materials.markAllDirty();
+		scene.lights.markAllDirty();
 	}
 
-	VkRenderPassBeginInfo renderPassInfo{};
-	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-	renderPassInfo.renderPass = vkRenderPass;
-	renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
-	renderPassInfo.renderArea.offset = { 0, 0 };
-	renderPassInfo.renderArea.extent = swapChainImageExtent;
-	VkClearValue clearColor = { {{0.0f, 0.0f, 0.0f, 1.0f}} };
-	renderPassInfo.clearValueCount = 1;
-	renderPassInfo.pClearValues = &clearColor;
-
-	vkCmdBeginRenderPass(vkCommandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-	vkCmdBindPipeline(vkCommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vkGraphicsPipeline);
-	VkViewport viewport{};
-	viewport.x = 0.0f;
-	viewport.y = 0.0f;
-	viewport.width = static_cast<float>(swapChainImageExtent.width);
-	viewport.height = static_cast<float>(swapChainImageExtent.height);
-	viewport.minDepth = 0.0f;
-	viewport.maxDepth = 1.0f;
-	vkCmdSetViewport(vkCommandBuffer, 0, 1, &viewport);
+	//2. Gather the dirty runs
+	auto instanceRanges = scene.instances.dirtyRanges();
+	auto materialRanges = scene.materials.dirtyRanges();
+	auto lightRanges = scene.lights.dirtyRanges();
+	VkDeviceSize bytes = 0;
+	for (const auto& range : instanceRanges) bytes += range.second * sizeof(InstanceRecord);
+	for (const auto& range : materialRanges) bytes += range.second * sizeof(MaterialRecord);
+	for (const auto& range : lightRanges) bytes += range.second * sizeof(LightRecord);
+	scene.instances.dirty.clear();
+	scene.materials.dirty.clear();
+	scene.lights.dirty.clear();
+
+	if (bytes > 0)
+	{
+		//3. Stage them in this frame's buffer, free since its frame slot was waited on
+		SceneBuffer& staging = frames[currentFrame].sceneStaging;
+		reserveSceneBuffer(staging, bytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+		std::vector<VkBufferCopy> instanceCopies;
+		std::vector<VkBufferCopy> materialCopies;
+		std::vector<VkBufferCopy> lightCopies;
+		VkDeviceSize stagingOffset = 0;
+		auto stage = [&](const void* records, size_t recordSize, const std::vector<std::pair<uint32_t, uint32_t>>& ranges, std::vector<VkBufferCopy>& copies) {
+			for (const auto& range : ranges)
+			{
+				VkBufferCopy copy{};
+				copy.srcOffset = stagingOffset;
+				copy.dstOffset = range.first * recordSize;
+				copy.size = range.second * recordSize;
+				memcpy(static_cast<uint8_t*>(staging.mapped) + copy.srcOffset, static_cast<const uint8_t*>(records) + copy.dstOffset, copy.size);
+				copies.push_back(copy);
+				stagingOffset += copy.size;
+			}
+		};
+		stage(scene.instances.records.data(), sizeof(InstanceRecord), instanceRanges, instanceCopies);
+		stage(scene.materials.records.data(), sizeof(MaterialRecord), materialRanges, materialCopies);
+		stage(scene.lights.records.data(), sizeof(LightRecord), lightRanges, lightCopies);
 
-	VkRect2D scissor{};
-	scissor.offset = { 0, 0 };
-	scissor.extent = swapChainImageExtent;
-	vkCmdSetScissor(vkCommandBuffer, 0, 1, &scissor);
+		//4. Previous frames' shader reads finish before the copies overwrite records in place
+		VkPipelineStageFlags readStages = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+		vkCmdPipelineBarrier(commandBuffer, readStages, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
 
-	vkCmdDraw(vkCommandBuffer, 3, 1, 0, 0);
+		if (!instanceCopies.empty())
+		{
+			vkCmdCopyBuffer(commandBuffer, staging.buffer, instanceBuffer.buffer, static_cast<uint32_t>(instanceCopies.size()), instanceCopies.data());
+		}
+		if (!materialCopies.empty())
+		{
+			vkCmdCopyBuffer(commandBuffer, staging.buffer, materialBuffer.buffer, static_cast<uint32_t>(materialCopies.size()), materialCopies.data());
+		}
+		if (!lightCopies.empty())
+		{
+			vkCmdCopyBuffer(commandBuffer, staging.buffer, lightBuffer.buffer, static_cast<uint32_t>(lightCopies.size()), lightCopies.data());
+		}
 
-	vkCmdEndRenderPass(vkCommandBuffer);
+		VkMemoryBarrier uploadBarrier{};
+		uploadBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		uploadBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		uploadBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, readStages, 0, 1, &uploadBarrier, 0, nullptr, 0, nullptr);
+	}
 
-	if (vkEndCommandBuffer(vkCommandBuffer) != VK_SUCCESS) 
+	//5. Metrics
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	sceneStats.frames++;
+	sceneStats.uploadedBytes += bytes;
+	sceneStats.maxFrameBytes = std::max<uint64_t>(sceneStats.maxFrameBytes, bytes);
+	if (rebuilt)
 	{
-		throw std::runtime_error("failed to record command buffer!");
+		sceneStats.rebuilds++;
+		sceneStats.rebuildMs += ms;
+	}
+	else if (bytes > 0)
+	{
+		sceneStats.inPlaceUpdates++;
+		sceneStats.updateMs += ms;
 	}
 }